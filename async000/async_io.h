@@ -0,0 +1,513 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <new>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Alignment of O_DIRECT buffers, offsets and lengths.
+constexpr auto DIRECT_ALIGNMENT = size_t(4096);
+// Largest piece of a request sent to io_uring at once; a large request
+// becomes many pieces in flight together, which fast drives need.
+constexpr auto IO_PIECE = size_t(1) << 20;
+// Opcodes io_queue asks the kernel about, more than any kernel has.
+constexpr auto IO_PROBE_OPS = 256u;
+
+inline std::system_error file_error(const std::string &what,
+                                    int error = errno) {
+  return std::system_error(error, std::generic_category(), what);
+}
+
+// Owns a file descriptor.
+class unique_fd {
+public:
+  unique_fd() = default;
+  explicit unique_fd(int fd) : fd(fd) {}
+  unique_fd(const std::string &path, int flags, mode_t mode = 0644)
+      : fd(::open(path.c_str(), flags, mode)) {
+    if (fd < 0)
+      throw file_error("cannot open " + path);
+  }
+  ~unique_fd() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+  unique_fd(unique_fd &&other) : fd(other.fd) { other.fd = -1; }
+  unique_fd &operator=(unique_fd &&other) {
+    std::swap(fd, other.fd);
+    return *this;
+  }
+  unique_fd(const unique_fd &) = delete;
+  unique_fd &operator=(const unique_fd &) = delete;
+
+  int get() const { return fd; }
+
+  uint64_t size() const {
+    struct stat status;
+    if (::fstat(fd, &status) != 0)
+      throw file_error("cannot stat file");
+    return uint64_t(status.st_size);
+  }
+
+  // An anonymous file in dir, gone as soon as it is closed.
+  static unique_fd temporary(const std::string &dir) {
+    auto path = dir + "/sort-run-XXXXXX";
+    auto fd = ::mkstemp(&path[0]);
+    if (fd < 0)
+      throw file_error("cannot create a temporary file in " + dir);
+    ::unlink(path.c_str());
+    return unique_fd(fd);
+  }
+
+private:
+  int fd = -1;
+};
+
+// pread and pwrite until all bytes are transferred.
+inline void read_at(int fd, void *data, size_t bytes, uint64_t offset) {
+  auto out = static_cast<char *>(data);
+  while (bytes > 0) {
+    auto done = ::pread(fd, out, bytes, off_t(offset));
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done == 0)
+      throw file_error("unexpected end of file", EIO);
+    if (done < 0)
+      throw file_error("read failed");
+    out += done;
+    bytes -= size_t(done);
+    offset += uint64_t(done);
+  }
+}
+
+inline void write_at(int fd, const void *data, size_t bytes,
+                     uint64_t offset) {
+  auto in = static_cast<const char *>(data);
+  while (bytes > 0) {
+    auto done = ::pwrite(fd, in, bytes, off_t(offset));
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done < 0)
+      throw file_error("write failed");
+    in += done;
+    bytes -= size_t(done);
+    offset += uint64_t(done);
+  }
+}
+
+// A file with an optional second descriptor opened with O_DIRECT. Aligned
+// transfers go through the direct one, bypassing the page cache; the rest,
+// such as the tail of a run, through the buffered one. Both see the same
+// data, since direct I/O writes back and drops the cached pages it covers.
+struct io_file {
+  unique_fd buffered;
+  unique_fd direct;
+
+  io_file() = default;
+  // access is O_RDONLY, O_WRONLY or O_RDWR, as file was opened.
+  explicit io_file(unique_fd file, bool direct_io = false,
+                   int access = O_RDWR)
+      : buffered(std::move(file)) {
+    // Reopening through /proc also works for unlinked temporary files.
+    // File systems without O_DIRECT refuse it, which leaves the file
+    // buffered.
+    if (direct_io)
+      direct = unique_fd(::open(
+          ("/proc/self/fd/" + std::to_string(buffered.get())).c_str(),
+          access | O_DIRECT));
+  }
+
+  int descriptor(const void *data, size_t bytes, uint64_t offset) const {
+    auto aligned = (uintptr_t(data) | bytes | offset) % DIRECT_ALIGNMENT == 0;
+    return aligned && direct.get() >= 0 ? direct.get() : buffered.get();
+  }
+};
+
+// Allocates on DIRECT_ALIGNMENT boundaries, so vectors can be O_DIRECT
+// buffers.
+template <typename T> struct aligned_allocator {
+  using value_type = T;
+
+  aligned_allocator() = default;
+  template <typename U> aligned_allocator(const aligned_allocator<U> &) {}
+
+  T *allocate(size_t n) {
+    void *data = nullptr;
+    if (::posix_memalign(&data, DIRECT_ALIGNMENT,
+                         std::max<size_t>(n * sizeof(T), 1)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T *>(data);
+  }
+  void deallocate(T *data, size_t) { std::free(data); }
+
+  template <typename U> bool operator==(const aligned_allocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const aligned_allocator<U> &) const {
+    return false;
+  }
+};
+
+template <typename T> using io_buffer = std::vector<T, aligned_allocator<T>>;
+
+// Reads and writes that run while the caller goes on. Requests return a
+// ticket to wait for, which throws what the transfer failed with. With
+// io_uring, requests are cut into IO_PIECE pieces that share one queue of
+// depth entries, and buffers registered with register_buffers are read and
+// written without mapping them per request. Kernels before Linux 5.6 lack
+// the plain read and write opcodes and get the vectored ones. Without
+// io_uring, because the kernel is too old or a sandbox forbids it, every
+// request runs pread or pwrite on a thread of its own. Empty requests get
+// ticket 0, which needs no waiting. One thread at a time may use a queue.
+class io_queue {
+public:
+  explicit io_queue(unsigned depth = 64, bool use_io_uring = true) {
+    if (use_io_uring)
+      setup(depth);
+  }
+
+  ~io_queue() {
+    while (ring_fd >= 0 && in_flight > 0)
+      reap(true);
+    for (auto &&task : tasks)
+      task.second.wait();
+    if (ring_fd < 0)
+      return;
+    ::munmap(sqes, entries * sizeof(io_uring_sqe));
+    if (cq_ring != sq_ring)
+      ::munmap(cq_ring, cq_ring_size);
+    ::munmap(sq_ring, sq_ring_size);
+    ::close(ring_fd);
+  }
+
+  io_queue(const io_queue &) = delete;
+  io_queue &operator=(const io_queue &) = delete;
+
+  bool uses_io_uring() const { return ring_fd >= 0; }
+
+  uint64_t read(const io_file &file, void *data, size_t bytes,
+                uint64_t offset) {
+    return request(file, data, bytes, offset, false);
+  }
+
+  uint64_t write(const io_file &file, const void *data, size_t bytes,
+                 uint64_t offset) {
+    return request(file, const_cast<void *>(data), bytes, offset, true);
+  }
+
+  void wait(uint64_t ticket) {
+    if (ticket == 0)
+      return;
+    if (ring_fd < 0) {
+      auto task = tasks.find(ticket);
+      auto result = std::move(task->second);
+      tasks.erase(task);
+      result.get();
+      return;
+    }
+    auto state = tickets.find(ticket);
+    while (state->second.pieces > 0)
+      reap(true);
+    auto error = state->second.error;
+    tickets.erase(state);
+    if (error != 0)
+      throw file_error("asynchronous I/O failed", error);
+  }
+
+  // Registers the buffers requests are made from, replacing those
+  // registered before. Nothing may be in flight. Registration pins the
+  // buffers and may exceed RLIMIT_MEMLOCK, in which case requests simply
+  // map their buffers as usual.
+  void register_buffers(const std::vector<iovec> &buffers) {
+    if (ring_fd < 0 || !fixed_opcodes)
+      return;
+    if (!registered.empty())
+      enter_register(IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    registered.clear();
+    auto used = std::vector<iovec>();
+    for (auto &&buffer : buffers) {
+      if (buffer.iov_len > 0)
+        used.push_back(buffer);
+    }
+    if (!used.empty() &&
+        enter_register(IORING_REGISTER_BUFFERS, used.data(),
+                       unsigned(used.size())) == 0)
+      registered = used;
+  }
+
+private:
+  struct piece {
+    uint64_t ticket;
+    char *data;
+    size_t bytes;
+    uint64_t offset;
+    int fd;
+    int buffered_fd; // for the rest of a short transfer, which is unaligned
+    bool write;
+    iovec vector; // of the vectored opcodes
+  };
+
+  struct ticket_state {
+    size_t pieces = 0;
+    int error = 0;
+  };
+
+  void setup(unsigned depth) {
+    auto params = io_uring_params();
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = int(::syscall(__NR_io_uring_setup, depth, &params));
+    if (ring_fd < 0)
+      return;
+    if (!probe_opcodes()) {
+      ::close(ring_fd);
+      ring_fd = -1;
+      return;
+    }
+    entries = params.sq_entries;
+    sq_ring_size = params.sq_off.array + entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    auto single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = map_ring(sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring : map_ring(cq_ring_size, IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe *>(
+        map_ring(entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+    if (!sq_ring || !cq_ring || !sqes) {
+      ::close(ring_fd);
+      ring_fd = -1;
+      return;
+    }
+    auto sq = static_cast<char *>(sq_ring);
+    auto cq = static_cast<char *>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    slots.resize(entries);
+    for (auto slot = entries; slot > 0; --slot)
+      free_slots.push_back(slot - 1);
+  }
+
+  void *map_ring(size_t size, off_t offset) {
+    auto ring = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return ring == MAP_FAILED ? nullptr : ring;
+  }
+
+  int enter_register(unsigned opcode, const void *arg, unsigned count) {
+    return int(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, count));
+  }
+
+  // Picks the transfer opcodes the kernel supports, and returns false if it
+  // has no read and write pair. IORING_OP_READ and WRITE came in Linux 5.6
+  // together with the probe, so a kernel that cannot probe gets READV and
+  // WRITEV, which io_uring always had, as well as the fixed opcodes.
+  bool probe_opcodes() {
+    auto buffer = std::vector<uint64_t>(
+        (sizeof(io_uring_probe) + IO_PROBE_OPS * sizeof(io_uring_probe_op)) /
+            sizeof(uint64_t) +
+        1);
+    auto probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+    if (enter_register(IORING_REGISTER_PROBE, probe, IO_PROBE_OPS) < 0) {
+      read_opcode = IORING_OP_READV;
+      write_opcode = IORING_OP_WRITEV;
+      return true;
+    }
+    auto supported = [probe](unsigned opcode) {
+      return opcode < probe->ops_len &&
+             (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    };
+    if (supported(IORING_OP_READ) && supported(IORING_OP_WRITE)) {
+      read_opcode = IORING_OP_READ;
+      write_opcode = IORING_OP_WRITE;
+    } else if (supported(IORING_OP_READV) && supported(IORING_OP_WRITEV)) {
+      read_opcode = IORING_OP_READV;
+      write_opcode = IORING_OP_WRITEV;
+    } else {
+      return false;
+    }
+    fixed_opcodes = supported(IORING_OP_READ_FIXED) &&
+                    supported(IORING_OP_WRITE_FIXED);
+    return true;
+  }
+
+  uint64_t request(const io_file &file, void *data, size_t bytes,
+                   uint64_t offset, bool write) {
+    if (bytes == 0)
+      return 0;
+    auto ticket = next_ticket++;
+    if (ring_fd < 0) {
+      auto fd = file.buffered.get();
+      tasks.emplace(ticket, std::async(std::launch::async, [=] {
+                      if (write)
+                        write_at(fd, data, bytes, offset);
+                      else
+                        read_at(fd, data, bytes, offset);
+                    }));
+      return ticket;
+    }
+    auto &state = tickets[ticket];
+    auto bytes_data = static_cast<char *>(data);
+    for (auto done = size_t(0); done < bytes; done += IO_PIECE) {
+      auto size = std::min(IO_PIECE, bytes - done);
+      auto fd = file.descriptor(bytes_data + done, size, offset + done);
+      ++state.pieces;
+      queue(piece{ticket, bytes_data + done, size, offset + done, fd,
+                  file.buffered.get(), write, {bytes_data + done, size}});
+    }
+    submit();
+    return ticket;
+  }
+
+  void queue(const piece &transfer) {
+    while (free_slots.empty()) {
+      submit();
+      reap(true);
+    }
+    auto slot = free_slots.back();
+    free_slots.pop_back();
+    slots[slot] = transfer;
+    auto tail = *sq_tail;
+    auto index = tail & sq_mask;
+    auto &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = transfer.fd;
+    sqe.off = transfer.offset;
+    sqe.addr = uint64_t(uintptr_t(transfer.data));
+    sqe.len = unsigned(transfer.bytes);
+    sqe.user_data = slot;
+    auto buffer = registered_buffer(transfer.data, transfer.bytes);
+    if (buffer >= 0) {
+      sqe.opcode = transfer.write ? IORING_OP_WRITE_FIXED
+                                  : IORING_OP_READ_FIXED;
+      sqe.buf_index = uint16_t(buffer);
+    } else {
+      sqe.opcode = transfer.write ? write_opcode : read_opcode;
+      if (sqe.opcode == IORING_OP_READV || sqe.opcode == IORING_OP_WRITEV) {
+        sqe.addr = uint64_t(uintptr_t(&slots[slot].vector));
+        sqe.len = 1;
+      }
+    }
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++unsubmitted;
+    ++in_flight;
+  }
+
+  int registered_buffer(const char *data, size_t bytes) const {
+    for (auto i = size_t(0); i < registered.size(); ++i) {
+      auto base = static_cast<const char *>(registered[i].iov_base);
+      if (data >= base && data + bytes <= base + registered[i].iov_len)
+        return int(i);
+    }
+    return -1;
+  }
+
+  void submit() {
+    while (unsubmitted > 0) {
+      auto done = int(::syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 0,
+                                0, nullptr, 0));
+      if (done < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        throw file_error("io_uring_enter failed");
+      if (done > 0)
+        unsubmitted -= unsigned(done);
+      else
+        reap(false);
+    }
+  }
+
+  // Completes what has finished, waiting for at least one if wait is set.
+  void reap(bool wait) {
+    auto head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (!wait || in_flight == 0)
+        return;
+      auto done = int(::syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                                IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (done < 0 && errno != EINTR)
+        throw file_error("io_uring_enter failed");
+    }
+    do {
+      auto &cqe = cqes[head & cq_mask];
+      complete(size_t(cqe.user_data), cqe.res);
+      ++head;
+    } while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // Finishes a short transfer with pread or pwrite, which is rare enough
+  // that it need not be asynchronous.
+  void complete(size_t slot, int result) {
+    auto transfer = slots[slot];
+    free_slots.push_back(slot);
+    --in_flight;
+    auto &state = tickets[transfer.ticket];
+    --state.pieces;
+    if (result < 0) {
+      state.error = -result;
+      return;
+    }
+    auto done = size_t(result);
+    if (done == transfer.bytes)
+      return;
+    try {
+      if (transfer.write)
+        write_at(transfer.buffered_fd, transfer.data + done,
+                 transfer.bytes - done, transfer.offset + done);
+      else
+        read_at(transfer.buffered_fd, transfer.data + done,
+                transfer.bytes - done, transfer.offset + done);
+    } catch (const std::system_error &error) {
+      state.error = error.code().value();
+    }
+  }
+
+  int ring_fd = -1;
+  uint8_t read_opcode = IORING_OP_READ;
+  uint8_t write_opcode = IORING_OP_WRITE;
+  bool fixed_opcodes = true;
+  unsigned entries = 0;
+  size_t sq_ring_size = 0;
+  size_t cq_ring_size = 0;
+  void *sq_ring = nullptr;
+  void *cq_ring = nullptr;
+  io_uring_sqe *sqes = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned *sq_array = nullptr;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+  unsigned unsubmitted = 0;
+  size_t in_flight = 0;
+
+  std::vector<piece> slots;
+  std::vector<size_t> free_slots;
+  std::vector<iovec> registered;
+  std::unordered_map<uint64_t, ticket_state> tickets;
+  std::unordered_map<uint64_t, std::future<void>> tasks;
+  uint64_t next_ticket = 1;
+};
@@ -0,0 +1,516 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+#include "tuning.h"
+
+// The Makefile passes the flags the benchmark was built with.
+#ifndef BENCHMARK_CXXFLAGS
+#define BENCHMARK_CXXFLAGS "unknown"
+#endif
+
+constexpr auto BENCHMARK_USAGE =
+    "usage: sort [options]\n"
+    "  --sizes=LIST          element counts, e.g. 1e6,4e6 or 1e3..1e9 for\n"
+    "                        every power of ten in between\n"
+    "  --threads=LIST        thread counts, e.g. 1,8 or 1..all for 1, 2, 4, ...\n"
+    "                        up to all hardware threads\n"
+    "  --weak-scaling        grow the sizes with the thread count\n"
+    "  --distributions=LIST  only these input distributions\n"
+    "  --algorithms=LIST     only these algorithms\n"
+    "  --warmup=N            untimed runs before measuring, default 0\n"
+    "  --repetitions=N       timed runs per measurement, default 1\n"
+    "  --json=FILE           also write the results as JSON\n"
+    "  --csv=FILE            also write the results as CSV\n"
+    "  --counters            read hardware performance counters\n"
+    "  --count-operations    count the comparisons, copies, moves and swaps\n"
+    "                        of the comparison sorts instead of timing\n"
+    "  --profile=FILE        per-machine cutoff profile, default ~/.sort_cutoffs\n"
+    "  --retune              measure the cutoffs again even if FILE has them\n"
+    "  --leaf-size=N         override the sequential leaf size of the profile\n"
+    "  --task-grain=N        override the task grain of the profile\n"
+    "  --max-threads=N       threads each sort may use, default all\n"
+    "  --scratch-budget=N    bytes of scratch memory each sort may use\n"
+    "  --external            sort a file of the keys through temporary run\n"
+    "                        files\n"
+    "  --mapped              sort a file of the keys in place through mmap\n"
+    "  --memory-budget=N     bytes of memory of --external, default a quarter\n"
+    "                        of the input\n"
+    "  --temp-dir=DIR        directory of the key files, default /tmp\n"
+    "  --direct-io           --external with O_DIRECT where aligned\n"
+    "  --no-io-uring         --external with pread and pwrite on threads\n"
+    "  --payload=BYTES       time sort_by_key with 8, 16, 32 or 64-byte values\n"
+    "                        instead\n";
+
+struct benchmark_options {
+  std::vector<size_t> sizes;
+  std::vector<unsigned> threads;
+  std::vector<std::string> distributions; // all if empty
+  std::vector<std::string> algorithms;    // all if empty
+  // Sizes are per threads.front() threads and grow with the thread count.
+  bool weak_scaling = false;
+  size_t warmup = 0;
+  size_t repetitions = 1;
+  std::string json_file;
+  std::string csv_file;
+  bool counters = false;
+  bool count_operations = false;
+  std::string profile_file = default_profile_file();
+  bool retune = false;
+  size_t leaf_size = 0;  // from the profile if 0
+  size_t task_grain = 0; // from the profile if 0
+  unsigned max_threads = 0;
+  size_t scratch_budget = SIZE_MAX;
+  bool external = false;
+  bool mapped = false;
+  size_t memory_budget = 0; // a quarter of the input if 0
+  std::string temp_dir = "/tmp";
+  bool direct_io = false;
+  bool use_io_uring = true;
+  size_t payload = 0; // bytes of the sort_by_key values, 0 for none
+};
+
+inline std::vector<std::string> split_list(const std::string &list) {
+  auto items = std::vector<std::string>();
+  auto start = size_t(0);
+  for (;;) {
+    auto comma = list.find(',', start);
+    items.push_back(list.substr(start, comma - start));
+    if (comma == std::string::npos)
+      return items;
+    start = comma + 1;
+  }
+}
+
+// Accepts scientific notation, as in 1e7.
+inline size_t parse_size(const std::string &text, double min = 1) {
+  auto used = size_t(0);
+  auto value = 0.0;
+  try {
+    value = std::stod(text, &used);
+  } catch (const std::logic_error &) {
+  }
+  if (used != text.size() || value < min)
+    throw std::invalid_argument("invalid size: " + text);
+  return size_t(value);
+}
+
+inline std::vector<size_t> parse_sizes(const std::string &text) {
+  auto range = text.find("..");
+  if (range == std::string::npos) {
+    auto sizes = std::vector<size_t>();
+    for (auto &&item : split_list(text))
+      sizes.push_back(parse_size(item));
+    return sizes;
+  }
+  auto last = parse_size(text.substr(range + 2));
+  auto sizes = std::vector<size_t>();
+  for (auto size = parse_size(text.substr(0, range)); size <= last; size *= 10)
+    sizes.push_back(size);
+  return sizes;
+}
+
+inline unsigned parse_thread_count(const std::string &text) {
+  if (text == "all")
+    return std::max(std::thread::hardware_concurrency(), 1u);
+  auto threads = parse_size(text);
+  return unsigned(threads);
+}
+
+inline std::vector<unsigned> parse_threads(const std::string &text) {
+  auto range = text.find("..");
+  if (range == std::string::npos) {
+    auto threads = std::vector<unsigned>();
+    for (auto &&item : split_list(text))
+      threads.push_back(parse_thread_count(item));
+    return threads;
+  }
+  auto last = parse_thread_count(text.substr(range + 2));
+  auto threads = std::vector<unsigned>();
+  for (auto count = parse_thread_count(text.substr(0, range)); count < last;
+       count *= 2)
+    threads.push_back(count);
+  threads.push_back(last);
+  return threads;
+}
+
+inline benchmark_options parse_benchmark_options(int argc, char **argv,
+                                                 size_t default_size) {
+  auto options = benchmark_options();
+  options.sizes = {default_size};
+  options.threads = {parse_thread_count("all")};
+  for (auto i = 1; i < argc; ++i) {
+    auto argument = std::string(argv[i]);
+    auto equals = argument.find('=');
+    auto name = argument.substr(0, equals);
+    auto value = equals == std::string::npos ? "" : argument.substr(equals + 1);
+    if (name == "--sizes")
+      options.sizes = parse_sizes(value);
+    else if (name == "--threads")
+      options.threads = parse_threads(value);
+    else if (name == "--weak-scaling")
+      options.weak_scaling = true;
+    else if (name == "--distributions")
+      options.distributions = split_list(value);
+    else if (name == "--algorithms")
+      options.algorithms = split_list(value);
+    else if (name == "--warmup")
+      options.warmup = parse_size(value, 0);
+    else if (name == "--repetitions")
+      options.repetitions = parse_size(value);
+    else if (name == "--json")
+      options.json_file = value;
+    else if (name == "--csv")
+      options.csv_file = value;
+    else if (name == "--counters")
+      options.counters = true;
+    else if (name == "--count-operations")
+      options.count_operations = true;
+    else if (name == "--profile")
+      options.profile_file = value;
+    else if (name == "--retune")
+      options.retune = true;
+    else if (name == "--leaf-size")
+      options.leaf_size = parse_size(value);
+    else if (name == "--task-grain")
+      options.task_grain = parse_size(value);
+    else if (name == "--max-threads")
+      options.max_threads = unsigned(parse_size(value));
+    else if (name == "--scratch-budget")
+      options.scratch_budget = parse_size(value, 0);
+    else if (name == "--external")
+      options.external = true;
+    else if (name == "--mapped")
+      options.mapped = true;
+    else if (name == "--memory-budget")
+      options.memory_budget = parse_size(value);
+    else if (name == "--temp-dir")
+      options.temp_dir = value;
+    else if (name == "--direct-io")
+      options.direct_io = true;
+    else if (name == "--no-io-uring")
+      options.use_io_uring = false;
+    else if (name == "--payload") {
+      options.payload = parse_size(value);
+      if (options.payload != 8 && options.payload != 16 &&
+          options.payload != 32 && options.payload != 64)
+        throw std::invalid_argument("invalid payload: " + value);
+    } else
+      throw std::invalid_argument("unknown option: " + argument);
+  }
+  if (options.external && options.mapped)
+    throw std::invalid_argument("--external and --mapped exclude each other");
+  return options;
+}
+
+inline bool selected(const std::vector<std::string> &filter,
+                     const std::string &name) {
+  return filter.empty() ||
+         std::find(filter.begin(), filter.end(), name) != filter.end();
+}
+
+// Summary of the repeated timings of one measurement, in seconds.
+struct timing {
+  std::vector<double> samples;
+  double min;
+  double median;
+  double p95;
+  double mean;
+  double stddev;
+};
+
+// Percentiles use the nearest rank, so they are always one of the samples.
+// There must be at least one sample.
+inline timing summarize(std::vector<double> samples) {
+  auto result = timing();
+  result.samples = samples;
+  std::sort(samples.begin(), samples.end());
+  auto n = samples.size();
+  auto rank = [&samples, n](double p) {
+    return samples[std::max(size_t(std::ceil(p * double(n))), size_t(1)) - 1];
+  };
+  result.min = samples.front();
+  result.median = n % 2 ? samples[n / 2]
+                        : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  result.p95 = rank(0.95);
+  auto sum = 0.0;
+  for (auto sample : samples)
+    sum += sample;
+  result.mean = sum / double(n);
+  auto squares = 0.0;
+  for (auto sample : samples)
+    squares += (sample - result.mean) * (sample - result.mean);
+  result.stddev = n > 1 ? std::sqrt(squares / double(n - 1)) : 0.0;
+  return result;
+}
+
+// seconds is the median, which the scaling report compares.
+struct measurement {
+  std::string distribution;
+  std::string algorithm;
+  bool parallel;
+  size_t size;
+  unsigned threads;
+  bool verified; // the output of every run was sorted
+  double seconds;
+  timing time;
+  std::vector<perf_counter_value> counters; // per element sorted
+};
+
+// Adds the counts of one run to the totals of the previous ones.
+inline void accumulate_counters(std::vector<perf_counter_value> &totals,
+                                const std::vector<perf_counter_value> &run) {
+  if (totals.empty()) {
+    totals = run;
+    return;
+  }
+  for (auto i = size_t(0); i < totals.size(); ++i) {
+    totals[i].value += run[i].value;
+    totals[i].valid = totals[i].valid && run[i].valid;
+  }
+}
+
+inline std::string format_counters(
+    const std::vector<perf_counter_value> &counters) {
+  auto out = std::ostringstream();
+  out << std::setprecision(4);
+  auto cycles = 0.0;
+  auto instructions = 0.0;
+  for (auto &&counter : counters) {
+    out << counter.name << " ";
+    if (counter.valid)
+      out << counter.value;
+    else
+      out << "n/a";
+    out << ", ";
+    if (counter.valid && counter.name == "cycles")
+      cycles = counter.value;
+    if (counter.valid && counter.name == "instructions")
+      instructions = counter.value;
+  }
+  if (cycles > 0 && instructions > 0)
+    out << "IPC " << instructions / cycles;
+  auto text = out.str();
+  if (text.size() >= 2 && text.compare(text.size() - 2, 2, ", ") == 0)
+    text.resize(text.size() - 2);
+  return text;
+}
+
+inline const measurement *find_measurement(
+    const std::vector<measurement> &results, const measurement &like,
+    size_t size, unsigned threads, const std::string &algorithm) {
+  for (auto &&result : results) {
+    if (result.distribution == like.distribution &&
+        result.algorithm == algorithm && result.size == size &&
+        result.threads == threads)
+      return result.verified ? &result : nullptr;
+  }
+  return nullptr;
+}
+
+// Throughput and scaling of every algorithm on every distribution. Strong
+// scaling compares with the same size on the first thread count, weak
+// scaling with size * first / threads elements on the first thread count.
+// The crossover is the smallest size from which on a parallel algorithm is
+// faster than the baseline at every larger size of the sweep; sizes without
+// a baseline measurement, as when --algorithms leaves it out, are skipped.
+inline void print_scaling_report(const std::vector<measurement> &results,
+                                 const benchmark_options &options,
+                                 const std::string &baseline) {
+  auto base_threads = options.threads.front();
+  auto printed = std::vector<std::string>();
+  for (auto &&first : results) {
+    auto key = first.distribution + "/" + first.algorithm;
+    if (std::find(printed.begin(), printed.end(), key) != printed.end())
+      continue;
+    printed.push_back(key);
+
+    std::cout << std::endl
+              << "scaling " << first.distribution << " " << first.algorithm
+              << std::endl
+              << std::setw(12) << "size" << std::setw(8) << "threads"
+              << std::setw(12) << "seconds" << std::setw(12) << "Melem/s"
+              << std::setw(8) << "strong" << std::setw(8) << "weak"
+              << std::endl;
+    for (auto &&result : results) {
+      if (result.distribution != first.distribution ||
+          result.algorithm != first.algorithm)
+        continue;
+      std::cout << std::setw(12) << result.size << std::setw(8)
+                << result.threads;
+      if (!result.verified) {
+        std::cout << std::setw(12) << "failed" << std::endl;
+        continue;
+      }
+      std::cout << std::setw(12) << result.seconds << std::setw(12)
+                << result.size / result.seconds / 1e6;
+      auto strong = find_measurement(results, result, result.size,
+                                     base_threads, result.algorithm);
+      if (strong)
+        std::cout << std::setw(8) << std::setprecision(3)
+                  << strong->seconds * base_threads /
+                         (result.seconds * result.threads);
+      else
+        std::cout << std::setw(8) << "-";
+      auto weak = result.size * base_threads % result.threads
+                      ? nullptr
+                      : find_measurement(results, result,
+                                         result.size * base_threads /
+                                             result.threads,
+                                         base_threads, result.algorithm);
+      if (weak)
+        std::cout << std::setw(8) << std::setprecision(3)
+                  << weak->seconds / result.seconds;
+      else
+        std::cout << std::setw(8) << "-";
+      std::cout << std::setprecision(6) << std::endl;
+    }
+  }
+
+  std::cout << std::endl << "crossover against " << baseline << std::endl;
+  auto reported = std::vector<std::string>();
+  for (auto &&first : results) {
+    if (!first.parallel)
+      continue;
+    auto key = first.distribution + "/" + first.algorithm + "/" +
+               std::to_string(first.threads);
+    if (std::find(reported.begin(), reported.end(), key) != reported.end())
+      continue;
+    reported.push_back(key);
+
+    auto crossover = size_t(0);
+    auto compared = false;
+    for (auto &&result : results) {
+      if (result.distribution != first.distribution ||
+          result.algorithm != first.algorithm ||
+          result.threads != first.threads || !result.verified)
+        continue;
+      auto base = find_measurement(results, result, result.size,
+                                   result.threads, baseline);
+      if (!base)
+        continue;
+      compared = true;
+      if (result.seconds >= base->seconds)
+        crossover = 0;
+      else if (crossover == 0)
+        crossover = result.size;
+    }
+    std::cout << std::setw(14) << first.distribution << std::setw(28)
+              << first.algorithm << std::setw(4) << first.threads
+              << " threads: ";
+    if (!compared)
+      std::cout << "no baseline" << std::endl;
+    else if (crossover)
+      std::cout << "faster from " << crossover << " elements" << std::endl;
+    else
+      std::cout << "never faster" << std::endl;
+  }
+}
+
+inline std::string compiler_version() {
+#if defined(__GNUC__) && !defined(__clang__)
+  return "GCC " __VERSION__;
+#elif defined(__VERSION__)
+  return __VERSION__;
+#else
+  return "unknown";
+#endif
+}
+
+inline std::string json_string(const std::string &text) {
+  auto result = std::string("\"");
+  for (auto c : text) {
+    if (c == '"' || c == '\\')
+      result += '\\';
+    if (c >= 0 && c < ' ')
+      continue;
+    result += c;
+  }
+  return result + "\"";
+}
+
+// Machine-readable results; every record carries the machine and build so
+// files from different runs can be compared.
+inline void write_json(const std::vector<measurement> &results,
+                       const benchmark_options &options,
+                       const std::string &file) {
+  auto out = std::ofstream(file);
+  out << std::setprecision(9) << "{\n"
+      << "  \"cpu\": " << json_string(cpu_model()) << ",\n"
+      << "  \"compiler\": " << json_string(compiler_version()) << ",\n"
+      << "  \"flags\": " << json_string(BENCHMARK_CXXFLAGS) << ",\n"
+      << "  \"warmup\": " << options.warmup << ",\n"
+      << "  \"repetitions\": " << options.repetitions << ",\n"
+      << "  \"results\": [";
+  for (auto i = size_t(0); i < results.size(); ++i) {
+    auto &&result = results[i];
+    out << (i ? "," : "") << "\n    {\"distribution\": "
+        << json_string(result.distribution)
+        << ", \"algorithm\": " << json_string(result.algorithm)
+        << ", \"size\": " << result.size
+        << ", \"threads\": " << result.threads
+        << ", \"verified\": " << (result.verified ? "true" : "false")
+        << ", \"min\": " << result.time.min
+        << ", \"median\": " << result.time.median
+        << ", \"p95\": " << result.time.p95
+        << ", \"mean\": " << result.time.mean
+        << ", \"stddev\": " << result.time.stddev << ", \"samples\": [";
+    for (auto j = size_t(0); j < result.time.samples.size(); ++j)
+      out << (j ? ", " : "") << result.time.samples[j];
+    out << "]";
+    if (!result.counters.empty()) {
+      out << ", \"counters_per_element\": {";
+      for (auto j = size_t(0); j < result.counters.size(); ++j) {
+        out << (j ? ", " : "") << json_string(result.counters[j].name)
+            << ": ";
+        if (result.counters[j].valid)
+          out << result.counters[j].value;
+        else
+          out << "null";
+      }
+      out << "}";
+    }
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+inline std::string csv_field(const std::string &text) {
+  auto result = std::string("\"");
+  for (auto c : text)
+    result += c == '"' ? std::string("\"\"") : std::string(1, c);
+  return result + "\"";
+}
+
+inline void write_csv(const std::vector<measurement> &results,
+                      const benchmark_options &options,
+                      const std::string &file) {
+  auto out = std::ofstream(file);
+  auto machine = csv_field(cpu_model()) + "," +
+                 csv_field(compiler_version()) + "," +
+                 csv_field(BENCHMARK_CXXFLAGS);
+  out << std::setprecision(9)
+      << "cpu,compiler,flags,distribution,algorithm,size,threads,warmup,"
+         "repetitions,verified,min,median,p95,mean,stddev\n";
+  for (auto &&result : results) {
+    out << machine << "," << csv_field(result.distribution) << ","
+        << csv_field(result.algorithm) << "," << result.size << ","
+        << result.threads << "," << options.warmup << ","
+        << options.repetitions << "," << result.verified << ","
+        << result.time.min << ","
+        << result.time.median << "," << result.time.p95 << ","
+        << result.time.mean << "," << result.time.stddev << "\n";
+  }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+// Operations performed on counted elements since the last reset. The
+// counters are shared by all threads, so the parallel sorts are counted too;
+// the relaxed increments slow the sorts down, which is fine in a mode that
+// does not time them.
+struct operation_counts {
+  std::atomic<uint64_t> comparisons{0};
+  std::atomic<uint64_t> copies{0};
+  std::atomic<uint64_t> moves{0};
+  std::atomic<uint64_t> swaps{0};
+
+  static operation_counts &get() {
+    static operation_counts counts;
+    return counts;
+  }
+
+  void reset() {
+    comparisons = 0;
+    copies = 0;
+    moves = 0;
+    swaps = 0;
+  }
+};
+
+inline void count_operation(std::atomic<uint64_t> &counter) {
+  counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Wraps a key and counts how often the sorts compare, copy, move and swap
+// it. Swaps made through std::iter_swap or unqualified swap count once; a
+// qualified std::swap shows up as three moves instead.
+template <typename T> class counted {
+public:
+  counted() = default;
+  counted(T value) : value(value) {}
+
+  counted(const counted &other) : value(other.value) {
+    count_operation(operation_counts::get().copies);
+  }
+  counted(counted &&other) : value(std::move(other.value)) {
+    count_operation(operation_counts::get().moves);
+  }
+  counted &operator=(const counted &other) {
+    count_operation(operation_counts::get().copies);
+    value = other.value;
+    return *this;
+  }
+  counted &operator=(counted &&other) {
+    count_operation(operation_counts::get().moves);
+    value = std::move(other.value);
+    return *this;
+  }
+
+  friend void swap(counted &a, counted &b) {
+    count_operation(operation_counts::get().swaps);
+    using std::swap;
+    swap(a.value, b.value);
+  }
+
+  friend bool operator<(const counted &a, const counted &b) {
+    count_operation(operation_counts::get().comparisons);
+    return a.value < b.value;
+  }
+  friend bool operator>(const counted &a, const counted &b) { return b < a; }
+  friend bool operator<=(const counted &a, const counted &b) {
+    return !(b < a);
+  }
+  friend bool operator>=(const counted &a, const counted &b) {
+    return !(a < b);
+  }
+  friend bool operator==(const counted &a, const counted &b) {
+    count_operation(operation_counts::get().comparisons);
+    return a.value == b.value;
+  }
+  friend bool operator!=(const counted &a, const counted &b) {
+    return !(a == b);
+  }
+
+  T value = T();
+};
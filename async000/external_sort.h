@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "async_io.h"
+#include "loser_tree.h"
+
+// Smallest block a run is read or written in during the merge.
+constexpr auto EXTERNAL_MIN_BLOCK = size_t(1) << 16;
+
+struct external_sort_options {
+  // Bytes of memory for run buffers and merge blocks. The in-memory sort
+  // that forms the runs may allocate its own scratch on top, within the
+  // scratch budget of its sort_options.
+  size_t memory_budget = size_t(1) << 30;
+  // Directory of the temporary run files, which are unlinked on creation.
+  std::string temp_dir = "/tmp";
+  // Most runs merged at once; more runs take several merge passes.
+  size_t max_fan_in = 256;
+  // Transfers through io_uring where the kernel allows, else pread and
+  // pwrite on helper threads.
+  bool use_io_uring = true;
+  // io_uring entries, each a piece of up to IO_PIECE bytes in flight.
+  unsigned queue_depth = 64;
+  // Aligned transfers bypass the page cache through O_DIRECT, for files
+  // far larger than it.
+  bool direct_io = false;
+};
+
+// Elements in a DIRECT_ALIGNMENT block, so runs and merge blocks of
+// multiples of it keep O_DIRECT transfers aligned.
+template <typename T> size_t direct_elements() {
+  return DIRECT_ALIGNMENT % sizeof(T) == 0 ? DIRECT_ALIGNMENT / sizeof(T) : 1;
+}
+
+template <typename T> size_t round_to_direct(size_t elements) {
+  auto unit = direct_elements<T>();
+  return std::max(elements / unit * unit, unit);
+}
+
+template <typename T> iovec buffer_iovec(io_buffer<T> &buffer) {
+  return {buffer.data(), buffer.size() * sizeof(T)};
+}
+
+// A sorted run of elements at an element offset in a run file.
+struct external_run {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Streams a run in blocks. The next block is read in the background while
+// the current one is merged.
+template <typename T> class run_reader {
+public:
+  run_reader(io_queue &io, const io_file &file, external_run run,
+             size_t block)
+      : io(io), file(file), next_offset(run.offset), left(run.size),
+        current(block), next(block) {}
+
+  void add_buffers(std::vector<iovec> &buffers) {
+    buffers.push_back(buffer_iovec(current));
+    buffers.push_back(buffer_iovec(next));
+  }
+
+  // Requests the first two blocks; the first one is waited for by ready().
+  void start() {
+    current_ticket = fetch(current, current_size);
+    next_ticket = fetch(next, next_size);
+  }
+  void ready() { io.wait(current_ticket); }
+
+  bool empty() const { return position == current_size; }
+  const T &front() const { return current[position]; }
+
+  void pop() {
+    if (++position < current_size)
+      return;
+    io.wait(next_ticket);
+    std::swap(current, next);
+    current_size = next_size;
+    position = 0;
+    next_ticket = fetch(next, next_size);
+  }
+
+private:
+  uint64_t fetch(io_buffer<T> &block, size_t &size) {
+    size = size_t(std::min<uint64_t>(block.size(), left));
+    auto ticket = io.read(file, block.data(), size * sizeof(T),
+                          next_offset * sizeof(T));
+    next_offset += size;
+    left -= size;
+    return ticket;
+  }
+
+  io_queue &io;
+  const io_file &file;
+  uint64_t next_offset;
+  uint64_t left;
+  io_buffer<T> current;
+  io_buffer<T> next;
+  size_t current_size = 0;
+  size_t next_size = 0;
+  size_t position = 0;
+  uint64_t current_ticket = 0;
+  uint64_t next_ticket = 0;
+};
+
+// Appends elements to a file in blocks; a full block is written in the
+// background while the next one fills.
+template <typename T> class run_writer {
+public:
+  run_writer(io_queue &io, const io_file &file, uint64_t offset, size_t block)
+      : io(io), file(file), offset(offset), current(block), flushing(block) {}
+
+  void add_buffers(std::vector<iovec> &buffers) {
+    buffers.push_back(buffer_iovec(current));
+    buffers.push_back(buffer_iovec(flushing));
+  }
+
+  void push(const T &value) {
+    current[size++] = value;
+    if (size == current.size())
+      flush();
+  }
+
+  // Writes what is left and waits for all writes.
+  void finish() {
+    flush();
+    io.wait(ticket);
+    pending = false;
+  }
+
+private:
+  void flush() {
+    if (pending)
+      io.wait(ticket);
+    std::swap(current, flushing);
+    ticket = io.write(file, flushing.data(), size * sizeof(T),
+                      offset * sizeof(T));
+    pending = true;
+    offset += size;
+    size = 0;
+  }
+
+  io_queue &io;
+  const io_file &file;
+  uint64_t offset;
+  io_buffer<T> current;
+  io_buffer<T> flushing;
+  size_t size = 0;
+  uint64_t ticket = 0;
+  bool pending = false;
+};
+
+// Merges runs of the file in into one run of out at offset through a
+// loser_tree over the run heads. All blocks are registered with io, and the
+// first two blocks of every run are requested at once.
+template <typename T>
+void merge_external_runs(io_queue &io, const io_file &in,
+                         const std::vector<external_run> &runs,
+                         const io_file &out, uint64_t offset, size_t block) {
+  auto readers = std::vector<std::unique_ptr<run_reader<T>>>();
+  for (auto &&run : runs)
+    readers.emplace_back(new run_reader<T>(io, in, run, block));
+  run_writer<T> writer(io, out, offset, block);
+  auto buffers = std::vector<iovec>();
+  for (auto &&reader : readers)
+    reader->add_buffers(buffers);
+  writer.add_buffers(buffers);
+  io.register_buffers(buffers);
+
+  for (auto &&reader : readers)
+    reader->start();
+  auto tree = loser_tree<T>(runs.size());
+  for (auto i = size_t(0); i < readers.size(); ++i) {
+    readers[i]->ready();
+    if (!readers[i]->empty())
+      tree.start(i, readers[i]->front());
+  }
+  tree.build();
+  while (!tree.empty()) {
+    auto &reader = *readers[tree.winner()];
+    writer.push(tree.top());
+    reader.pop();
+    if (reader.empty())
+      tree.remove();
+    else
+      tree.replace(reader.front());
+  }
+  writer.finish();
+  io.register_buffers({});
+}
+
+// Cuts the input into runs of run_size elements, sorts them with sort and
+// writes them to out. Three buffers rotate, so that while one run is
+// sorted, the previous one is written and the next one read.
+template <typename T>
+std::vector<external_run>
+write_sorted_runs(io_queue &io, const io_file &in, uint64_t size,
+                  const io_file &out, size_t run_size,
+                  const std::function<void(T *, T *)> &sort) {
+  auto runs = std::vector<external_run>();
+  for (auto offset = uint64_t(0); offset < size; offset += run_size)
+    runs.push_back({offset, std::min<uint64_t>(run_size, size - offset)});
+  auto spare = runs.size() > 1 ? run_size : 0;
+  auto sorting = io_buffer<T>(run_size);
+  auto reading = io_buffer<T>(spare);
+  auto writing = io_buffer<T>(spare);
+  io.register_buffers({buffer_iovec(sorting), buffer_iovec(reading),
+                       buffer_iovec(writing)});
+
+  io.wait(io.read(in, sorting.data(), runs[0].size * sizeof(T), 0));
+  auto written = uint64_t(0);
+  for (auto i = size_t(0); i < runs.size(); ++i) {
+    auto read = uint64_t(0); // none after the last run
+    if (i + 1 < runs.size())
+      read = io.read(in, reading.data(), runs[i + 1].size * sizeof(T),
+                     runs[i + 1].offset * sizeof(T));
+    sort(sorting.data(), sorting.data() + runs[i].size);
+    io.wait(written);
+    written = io.write(out, sorting.data(), runs[i].size * sizeof(T),
+                       runs[i].offset * sizeof(T));
+    io.wait(read);
+    std::swap(writing, sorting);
+    std::swap(sorting, reading);
+  }
+  io.wait(written);
+  io.register_buffers({});
+  return runs;
+}
+
+// Sorts the binary file input of fixed-width keys T into output, using about
+// options.memory_budget bytes of memory: runs of a third of the budget are
+// sorted in memory with sort and spilled to a temporary file, then merged in
+// passes of up to max_fan_in runs into the other temporary file and finally
+// into output. All transfers go through one io_queue. Input and output may
+// be the same file.
+template <typename T>
+void external_sort(const std::string &input, const std::string &output,
+                   const external_sort_options &options,
+                   const std::function<void(T *, T *)> &sort) {
+  auto in = io_file(unique_fd(input, O_RDONLY), options.direct_io, O_RDONLY);
+  if (in.buffered.size() % sizeof(T) != 0)
+    throw std::invalid_argument(input + " is not a whole number of keys");
+  auto size = in.buffered.size() / sizeof(T);
+  auto budget = std::max<size_t>(options.memory_budget / sizeof(T),
+                                 4 * EXTERNAL_MIN_BLOCK);
+  auto run_size = round_to_direct<T>(budget / 3);
+  auto open_output = [&] {
+    return io_file(unique_fd(output, O_WRONLY | O_CREAT | O_TRUNC),
+                   options.direct_io, O_WRONLY);
+  };
+
+  if (size <= run_size) {
+    auto keys = std::vector<T>(size_t(size));
+    read_at(in.buffered.get(), keys.data(), keys.size() * sizeof(T), 0);
+    sort(keys.data(), keys.data() + keys.size());
+    auto out = open_output();
+    write_at(out.buffered.get(), keys.data(), keys.size() * sizeof(T), 0);
+    return;
+  }
+
+  io_queue io(options.queue_depth, options.use_io_uring);
+  auto files = std::vector<io_file>();
+  for (auto i = 0; i < 2; ++i)
+    files.emplace_back(unique_fd::temporary(options.temp_dir),
+                       options.direct_io);
+  auto runs = write_sorted_runs<T>(io, in, size, files[0], run_size, sort);
+  in = io_file();
+
+  // Every merge holds two blocks per input and two for the output.
+  auto fan_in = std::max<size_t>(
+      std::min(options.max_fan_in, budget / EXTERNAL_MIN_BLOCK / 2 - 1), 2);
+  for (auto pass = 0;; ++pass) {
+    auto &from = files[pass % 2];
+    auto last = runs.size() <= fan_in;
+    auto out = last ? open_output() : std::move(files[(pass + 1) % 2]);
+    auto merged = std::vector<external_run>();
+    for (auto first = size_t(0); first < runs.size(); first += fan_in) {
+      auto group = std::vector<external_run>(
+          runs.begin() + first,
+          runs.begin() + std::min(first + fan_in, runs.size()));
+      auto offset = group.front().offset;
+      auto total = uint64_t(0);
+      for (auto &&run : group)
+        total += run.size;
+      auto block = round_to_direct<T>(budget / (2 * group.size() + 2));
+      merge_external_runs<T>(io, from, group, out, offset, block);
+      merged.push_back({offset, total});
+    }
+    if (last)
+      return;
+    files[(pass + 1) % 2] = std::move(out);
+    runs = merged;
+  }
+}
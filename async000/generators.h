@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "random.h"
+#include "thread_pool.h"
+
+// Input shape of the benchmark matrix. fill overwrites every key and always
+// produces the same keys for the same size, whatever the number of threads.
+struct input_distribution {
+  std::string name;
+  std::function<void(std::vector<int> &keys)> fill;
+};
+
+constexpr auto GENERATOR_CHUNK = size_t(1) << 16;
+
+// Sets keys[i] = key_at(i) for every i, in parallel chunks on the default
+// pool. key_at must depend on i only, which keeps the keys identical for any
+// number of threads.
+template <typename F>
+void generate_keys(std::vector<int> &keys, const F &key_at) {
+  auto size = keys.size();
+  auto &pool = default_pool();
+  auto chunks = std::max<size_t>(
+      std::min<size_t>(pool.concurrency() * 4, size / GENERATOR_CHUNK), 1);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      keys[i] = key_at(i);
+  });
+}
+
+// i-th of n increasing keys spread over the whole int range.
+inline int ramp_key(size_t i, size_t n) {
+  auto step = (uint64_t(1) << 32) / std::max<size_t>(n, 1);
+  return int(int64_t(std::numeric_limits<int>::min()) + int64_t(i * step));
+}
+
+inline void fill_uniform(std::vector<int> &keys, int min, int max) {
+  auto range = uint64_t(int64_t(max) - int64_t(min)) + 1;
+  generate_keys(keys, [min, range](size_t i) {
+    auto bits = counter_random(0, i) >> 32;
+    return int(int64_t(min) + int64_t((bits * range) >> 32));
+  });
+}
+
+inline void fill_sorted(std::vector<int> &keys) {
+  auto n = keys.size();
+  generate_keys(keys, [n](size_t i) { return ramp_key(i, n); });
+}
+
+inline void fill_reversed(std::vector<int> &keys) {
+  auto n = keys.size();
+  generate_keys(keys, [n](size_t i) { return ramp_key(n - 1 - i, n); });
+}
+
+// Sorted keys with swaps pairs exchanged at random positions. The swaps run
+// in order on one thread; they are few.
+inline void fill_almost_sorted(std::vector<int> &keys, size_t swaps) {
+  fill_sorted(keys);
+  if (keys.empty())
+    return;
+  for (auto i = size_t(0); i < swaps; ++i) {
+    std::swap(keys[counter_random(1, 2 * i) % keys.size()],
+              keys[counter_random(1, 2 * i + 1) % keys.size()]);
+  }
+}
+
+// Ascending up to the middle, then descending.
+inline void fill_organ_pipe(std::vector<int> &keys) {
+  auto n = keys.size();
+  generate_keys(keys,
+                [n](size_t i) { return ramp_key(std::min(i, n - 1 - i), n); });
+}
+
+// teeth ascending runs one after the other.
+inline void fill_sawtooth(std::vector<int> &keys, size_t teeth) {
+  auto period = std::max<size_t>(keys.size() / teeth, 1);
+  generate_keys(keys,
+                [period](size_t i) { return ramp_key(i % period, period); });
+}
+
+// Rank k out of values distinct keys is drawn with probability ~ 1 / k^s.
+inline void fill_zipf(std::vector<int> &keys, size_t values, double s) {
+  auto cumulative = std::vector<double>(values);
+  auto sum = 0.0;
+  for (auto k = size_t(0); k < values; ++k) {
+    sum += 1 / std::pow(double(k + 1), s);
+    cumulative[k] = sum;
+  }
+  generate_keys(keys, [&cumulative, sum, values](size_t i) {
+    auto rank = std::lower_bound(cumulative.begin(), cumulative.end(),
+                                 counter_random_real(2, i) * sum) -
+                cumulative.begin();
+    return int(std::min<ptrdiff_t>(rank, ptrdiff_t(values) - 1));
+  });
+}
+
+// The shapes the sorts are benchmarked on: uniform keys, presorted and
+// adversarial orders for the pivot and run logic, and duplicate-heavy keys
+// like the status codes and enum-like ids found in production.
+inline std::vector<input_distribution> input_distributions() {
+  return {
+      {"random",
+       [](std::vector<int> &keys) {
+         fill_uniform(keys, std::numeric_limits<int>::min(),
+                      std::numeric_limits<int>::max());
+       }},
+      {"sorted", fill_sorted},
+      {"reversed", fill_reversed},
+      {"almost_sorted",
+       [](std::vector<int> &keys) {
+         fill_almost_sorted(keys, keys.size() / 1000 + 1);
+       }},
+      {"few_unique",
+       [](std::vector<int> &keys) { fill_uniform(keys, -10, 10); }},
+      {"organ_pipe", fill_organ_pipe},
+      {"sawtooth", [](std::vector<int> &keys) { fill_sawtooth(keys, 32); }},
+      {"zipf", [](std::vector<int> &keys) { fill_zipf(keys, 1 << 20, 1.0); }},
+      {"all_equal",
+       [](std::vector<int> &keys) {
+         generate_keys(keys, [](size_t) { return 42; });
+       }},
+  };
+}
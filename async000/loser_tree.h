@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "sort.h"
+#include "thread_pool.h"
+
+// Tournament tree that selects the smallest head of k sorted sources with
+// about log2(k) comparisons. Every inner node keeps the loser of the match
+// played there together with a copy of its key, so replaying the winner's
+// path reads only the node array, whose top levels are shared by all paths
+// and stay in the first cache lines. Ties go to the lower source, which
+// keeps merges stable.
+template <typename T> class loser_tree {
+public:
+  explicit loser_tree(size_t sources) {
+    while (leaves < sources)
+      leaves *= 2;
+    nodes.resize(leaves);
+    initial.resize(leaves);
+    for (auto i = size_t(0); i < leaves; ++i)
+      initial[i].source = uint32_t(i);
+  }
+
+  // Gives source its first key; sources without one are empty.
+  void start(size_t source, const T &key) {
+    initial[source].key = key;
+    initial[source].exhausted = false;
+  }
+
+  // Plays the first tournament once every source has started.
+  void build() {
+    nodes[0] = play(1);
+    initial = std::vector<node>();
+  }
+
+  bool empty() const { return nodes[0].exhausted; }
+  size_t winner() const { return nodes[0].source; }
+  const T &top() const { return nodes[0].key; }
+
+  // The winner's source moved on to key.
+  void replace(const T &key) {
+    nodes[0].key = key;
+    replay();
+  }
+
+  // The winner's source is empty.
+  void remove() {
+    nodes[0].exhausted = true;
+    replay();
+  }
+
+private:
+  struct node {
+    T key = T();
+    uint32_t source = 0;
+    bool exhausted = true;
+  };
+
+  static bool beats(const node &a, const node &b) {
+    if (a.exhausted || b.exhausted)
+      return !a.exhausted;
+    return a.key < b.key || (!(b.key < a.key) && a.source < b.source);
+  }
+
+  // Winner of the subtree at index, leaving the losers in its inner nodes.
+  node play(size_t index) {
+    if (index >= leaves)
+      return initial[index - leaves];
+    auto winner = play(2 * index);
+    auto loser = play(2 * index + 1);
+    if (beats(loser, winner))
+      std::swap(winner, loser);
+    nodes[index] = std::move(loser);
+    return winner;
+  }
+
+  void replay() {
+    auto current = std::move(nodes[0]);
+    for (auto index = (leaves + current.source) / 2; index > 0; index /= 2) {
+      if (beats(nodes[index], current))
+        std::swap(nodes[index], current);
+    }
+    nodes[0] = std::move(current);
+  }
+
+  size_t leaves = 1;
+  std::vector<node> nodes; // winner at 0, losers at [1, leaves)
+  std::vector<node> initial;
+};
+
+template <typename Iterator>
+using sorted_ranges = std::vector<std::pair<Iterator, Iterator>>;
+
+// Moves the merge of the sorted ranges to out, ties going to the earlier
+// range as in std::merge.
+template <typename Iterator, typename Output>
+Output multiway_merge(const sorted_ranges<Iterator> &ranges, Output out) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto heads = std::vector<Iterator>();
+  auto tree = loser_tree<T>(ranges.size());
+  for (auto i = size_t(0); i < ranges.size(); ++i) {
+    heads.push_back(ranges[i].first);
+    if (ranges[i].first != ranges[i].second)
+      tree.start(i, *ranges[i].first);
+  }
+  tree.build();
+  while (!tree.empty()) {
+    auto source = tree.winner();
+    auto &head = heads[source];
+    *out = std::move(*head);
+    ++out;
+    if (++head != ranges[source].second)
+      tree.replace(*head);
+    else
+      tree.remove();
+  }
+  return out;
+}
+
+// co_rank for many ranges: how many of the first k outputs of
+// multiway_merge come from each range. Every range keeps an interval that
+// holds its answer; a pivot from the middle of the widest interval is
+// ranked in all ranges by binary search, and the intervals shrink to the
+// side of the pivot that k lies on.
+template <typename Iterator>
+std::vector<size_t> multiway_co_rank(size_t k,
+                                     const sorted_ranges<Iterator> &ranges) {
+  auto low = std::vector<size_t>(ranges.size());
+  auto high = std::vector<size_t>();
+  for (auto &&range : ranges)
+    high.push_back(size_t(std::distance(range.first, range.second)));
+  auto ranked = std::vector<size_t>(ranges.size());
+  for (;;) {
+    auto widest = size_t(0);
+    auto taken = size_t(0);
+    for (auto i = size_t(0); i < ranges.size(); ++i) {
+      taken += low[i];
+      if (high[i] - low[i] > high[widest] - low[widest])
+        widest = i;
+    }
+    if (taken == k || high[widest] == low[widest])
+      return low;
+    auto middle = low[widest] + (high[widest] - low[widest]) / 2;
+    auto &pivot = ranges[widest].first[middle];
+    auto before = size_t(0);
+    for (auto i = size_t(0); i < ranges.size(); ++i) {
+      auto first = ranges[i].first + low[i];
+      auto last = ranges[i].first + high[i];
+      if (i == widest)
+        ranked[i] = middle;
+      else if (i < widest)
+        ranked[i] = low[i] + size_t(std::upper_bound(first, last, pivot) -
+                                    first);
+      else
+        ranked[i] = low[i] + size_t(std::lower_bound(first, last, pivot) -
+                                    first);
+      before += ranked[i];
+    }
+    if (before == k)
+      return ranked;
+    if (before < k) {
+      low = ranked;
+      ++low[widest];
+    } else {
+      high = ranked;
+    }
+  }
+}
+
+// multiway_merge with the output cut into one segment per thread;
+// multiway_co_rank finds where each segment starts in every range, so the
+// segments are merged independently.
+template <typename Iterator, typename Output>
+void parallel_multiway_merge(
+    const sorted_ranges<Iterator> &ranges, Output out,
+    const sort_options &options = default_sort_options()) {
+  auto total = size_t(0);
+  for (auto &&range : ranges)
+    total += size_t(std::distance(range.first, range.second));
+  auto &pool = sort_pool(options);
+  auto pieces =
+      std::min<size_t>(pool.concurrency(), total / options.task_grain);
+  if (pieces < 2) {
+    multiway_merge(ranges, out);
+    return;
+  }
+  pool.parallel_for(0, pieces, [&](size_t piece) {
+    auto k0 = total * piece / pieces;
+    auto k1 = total * (piece + 1) / pieces;
+    auto begin = multiway_co_rank(k0, ranges);
+    auto end = multiway_co_rank(k1, ranges);
+    auto segment = sorted_ranges<Iterator>();
+    for (auto i = size_t(0); i < ranges.size(); ++i)
+      segment.emplace_back(ranges[i].first + begin[i],
+                           ranges[i].first + end[i]);
+    multiway_merge(segment, out + k0);
+  });
+}
+
+// Sorts one chunk per thread with merge_sort and merges all chunks in a
+// single parallel_multiway_merge through a buffer, so the merge phase moves
+// every element twice whatever the thread count, instead of once per level
+// of a merge tree.
+template <typename Iterator>
+void multiway_merge_sort(Iterator start, Iterator end,
+                         const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto size = size_t(std::distance(start, end));
+  auto &pool = sort_pool(options);
+  auto chunks =
+      std::min<size_t>(pool.concurrency(), size / options.task_grain);
+  if (chunks < 2 || !fits_scratch<T>(size, options)) {
+    async_merge_sort(start, end, options);
+    return;
+  }
+  auto ranges = sorted_ranges<Iterator>();
+  for (auto chunk = size_t(0); chunk < chunks; ++chunk)
+    ranges.emplace_back(start + size * chunk / chunks,
+                        start + size * (chunk + 1) / chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto part = size_t(ranges[chunk].second - ranges[chunk].first);
+    merge_sort(ranges[chunk].first, ranges[chunk].second,
+               scratch_share(options, part, size));
+  });
+  auto buffer = std::vector<T>(size);
+  parallel_multiway_merge(ranges, buffer.begin(), options);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    std::move(buffer.begin() + size * chunk / chunks,
+              buffer.begin() + size * (chunk + 1) / chunks,
+              start + size * chunk / chunks);
+  });
+}
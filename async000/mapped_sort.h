@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "async_io.h"
+
+// A file of fixed-width keys mapped shared and writable, so sorting the
+// keys in place sorts the file without copying it.
+template <typename T> class mapped_keys {
+public:
+  explicit mapped_keys(const std::string &path) {
+    auto file = unique_fd(path, O_RDWR);
+    bytes = size_t(file.size());
+    if (bytes % sizeof(T) != 0)
+      throw std::invalid_argument(path + " is not a whole number of keys");
+    if (bytes == 0)
+      return;
+    auto address = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          file.get(), 0);
+    if (address == MAP_FAILED)
+      throw file_error("cannot map " + path);
+    keys = static_cast<T *>(address);
+  }
+  ~mapped_keys() {
+    if (keys)
+      ::munmap(keys, bytes);
+  }
+  mapped_keys(const mapped_keys &) = delete;
+  mapped_keys &operator=(const mapped_keys &) = delete;
+
+  T *begin() const { return keys; }
+  T *end() const { return keys + size(); }
+  size_t size() const { return bytes / sizeof(T); }
+
+  // madvise is only a hint, so a kernel that does not know one is ignored.
+  void advise(int advice) const {
+    if (keys)
+      ::madvise(keys, bytes, advice);
+  }
+
+private:
+  T *keys = nullptr;
+  size_t bytes = 0;
+};
+
+// Sorts mapped keys in place with sort, backed by huge pages where the file
+// system allows. The sort jumps between pages in no fixed order, so the
+// mapping is advised as random, which stops the kernel from reading ahead
+// around every fault into pages the sort may not reach for a long time.
+template <typename T>
+void sort_mapped(const mapped_keys<T> &keys,
+                 const std::function<void(T *, T *)> &sort) {
+  keys.advise(MADV_HUGEPAGE);
+  keys.advise(MADV_RANDOM);
+  sort(keys.begin(), keys.end());
+}
+
+// Sorts the binary file path of fixed-width keys T in place through a
+// mapping. Writing the dirty pages back is left to the kernel; fsync the
+// file to wait for it.
+template <typename T>
+void sort_mapped_file(const std::string &path,
+                      const std::function<void(T *, T *)> &sort) {
+  mapped_keys<T> keys(path);
+  sort_mapped(keys, sort);
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "sort.h"
+#include "thread_pool.h"
+
+// Runs shorter than this are extended with binary insertion sort.
+constexpr auto NATURAL_MIN_RUN = size_t(32);
+// Consecutive wins of one side after which a merge starts galloping.
+constexpr auto NATURAL_MIN_GALLOP = size_t(7);
+
+// std::partition_point that probes 1, 3, 7, ... elements from the start
+// before the binary search, so a prefix of k elements costs O(log k).
+template <typename Iterator, typename Predicate>
+Iterator gallop(Iterator start, Iterator end, Predicate predicate) {
+  auto size = std::distance(start, end);
+  auto low = decltype(size)(0);
+  auto step = decltype(size)(1);
+  while (step <= size && predicate(start[step - 1])) {
+    low = step;
+    step = 2 * step + 1;
+  }
+  return std::partition_point(start + low, start + std::min(step, size),
+                              predicate);
+}
+
+// Ends the run that begins at start: the longest non-decreasing prefix, or
+// the longest strictly decreasing one reversed in place. Runs shorter than
+// NATURAL_MIN_RUN are extended by binary insertion.
+template <typename Iterator> Iterator next_run(Iterator start, Iterator end) {
+  auto run = start + 1;
+  if (run == end)
+    return run;
+  if (*run < *start) {
+    while (run != end && *run < run[-1])
+      ++run;
+    std::reverse(start, run);
+  } else {
+    while (run != end && !(*run < run[-1]))
+      ++run;
+  }
+  auto limit = start + std::min<ptrdiff_t>(NATURAL_MIN_RUN, end - start);
+  for (; run < limit; ++run)
+    std::rotate(std::upper_bound(start, run, *run), run, run + 1);
+  return run;
+}
+
+// Depth of the boundary between the runs [begin1, begin2) and
+// [begin2, end2) in the perfectly balanced merge tree over n elements: the
+// first bit in which the fractions midpoint / n of both runs differ.
+inline unsigned powersort_power(size_t begin1, size_t begin2, size_t end2,
+                                size_t n) {
+  // Twice the midpoints, to stay in integers.
+  auto a = uint64_t(begin1) + begin2;
+  auto b = uint64_t(begin2) + end2;
+  auto whole = 2 * uint64_t(n);
+  auto power = 0u;
+  for (;;) {
+    ++power;
+    a *= 2;
+    b *= 2;
+    auto a_high = a >= whole;
+    auto b_high = b >= whole;
+    if (a_high != b_high)
+      return power;
+    if (a_high) {
+      a -= whole;
+      b -= whole;
+    }
+  }
+}
+
+// Merges the range at buffer, which holds the first run, with [right, end)
+// into out, where out + (buffer_end - buffer) == right. Ties go to the
+// buffer. After NATURAL_MIN_GALLOP wins in a row by one side the merge
+// gallops, moving whole blocks found by gallop(); min_gallop adapts to how
+// well that pays off, as in TimSort.
+template <typename Buffer, typename Iterator, typename Less>
+void gallop_merge(Buffer buffer, Buffer buffer_end, Iterator right,
+                  Iterator end, Iterator out, Less less, size_t &min_gallop) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  while (buffer != buffer_end && right != end) {
+    auto buffer_wins = size_t(0);
+    auto right_wins = size_t(0);
+    while (buffer != buffer_end && right != end &&
+           std::max(buffer_wins, right_wins) < min_gallop) {
+      if (less(*right, *buffer)) {
+        *out++ = std::move(*right++);
+        ++right_wins;
+        buffer_wins = 0;
+      } else {
+        *out++ = std::move(*buffer++);
+        ++buffer_wins;
+        right_wins = 0;
+      }
+    }
+    while (buffer != buffer_end && right != end) {
+      auto buffer_block = gallop(buffer, buffer_end, [&](const T &value) {
+        return !less(*right, value);
+      });
+      auto buffer_count = size_t(buffer_block - buffer);
+      out = std::move(buffer, buffer_block, out);
+      buffer = buffer_block;
+      if (buffer == buffer_end)
+        break;
+      auto right_block = gallop(
+          right, end, [&](const T &value) { return less(value, *buffer); });
+      auto right_count = size_t(right_block - right);
+      out = std::move(right, right_block, out);
+      right = right_block;
+      if (buffer_count < NATURAL_MIN_GALLOP &&
+          right_count < NATURAL_MIN_GALLOP) {
+        ++min_gallop;
+        break;
+      }
+      min_gallop = std::max<size_t>(min_gallop - 1, 1);
+    }
+  }
+  std::move(buffer, buffer_end, out);
+}
+
+// Merges the adjacent sorted runs [start, middle) and [middle, end). The
+// elements already in place at both ends are skipped by galloping, and the
+// shorter remaining run is moved to the buffer: the left one to merge
+// forwards, the right one to merge backwards through reverse iterators.
+// Without a buffer large enough it is rotate_merge.
+template <typename Iterator, typename T>
+void natural_merge(Iterator start, Iterator middle, Iterator end,
+                   std::vector<T> &buffer, size_t &min_gallop) {
+  start = gallop(start, middle,
+                 [&](const T &value) { return !(*middle < value); });
+  if (start == middle)
+    return;
+  auto last = middle[-1];
+  end = gallop(middle, end, [&](const T &value) { return value < last; });
+  auto left = size_t(middle - start);
+  auto right = size_t(end - middle);
+  if (std::min(left, right) > buffer.size()) {
+    rotate_merge(start, middle, end);
+    return;
+  }
+  if (left <= right) {
+    auto buffer_end = std::move(start, middle, buffer.begin());
+    gallop_merge(buffer.begin(), buffer_end, middle, end, start,
+                 [](const T &a, const T &b) { return a < b; }, min_gallop);
+  } else {
+    using Reverse = std::reverse_iterator<Iterator>;
+    using ReverseBuffer =
+        std::reverse_iterator<typename std::vector<T>::iterator>;
+    auto buffer_end = std::move(middle, end, buffer.begin());
+    gallop_merge(ReverseBuffer(buffer_end), ReverseBuffer(buffer.begin()),
+                 Reverse(middle), Reverse(start), Reverse(end),
+                 [](const T &a, const T &b) { return b < a; }, min_gallop);
+  }
+}
+
+// Stable natural merge sort with the Powersort merge policy: every run is
+// pushed with the power of its boundary with the next one, and the runs on
+// the stack whose boundary is deeper in the balanced merge tree are merged
+// first. Presorted input is a single run and takes n - 1 comparisons; the
+// merge tree is within a few percent of optimal for any run lengths.
+template <typename Iterator>
+void natural_merge_sort(Iterator start, Iterator end,
+                        const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  struct run {
+    size_t begin;
+    size_t end;
+    unsigned power; // of the boundary with the run that follows it
+  };
+
+  auto n = size_t(std::distance(start, end));
+  if (n < 2)
+    return;
+  auto buffer = std::vector<T>(
+      fits_scratch<T>(n / 2, options) ? n / 2
+                                      : options.scratch_budget / sizeof(T));
+  auto min_gallop = NATURAL_MIN_GALLOP;
+  auto stack = std::vector<run>();
+  auto current = run{0, size_t(next_run(start, end) - start), 0};
+  while (current.end < n) {
+    auto next_end = size_t(next_run(start + current.end, end) - start);
+    auto power = powersort_power(current.begin, current.end, next_end, n);
+    while (!stack.empty() && stack.back().power > power) {
+      natural_merge(start + stack.back().begin, start + current.begin,
+                    start + current.end, buffer, min_gallop);
+      current.begin = stack.back().begin;
+      stack.pop_back();
+    }
+    current.power = power;
+    stack.push_back(current);
+    current = run{current.end, next_end, 0};
+  }
+  while (!stack.empty()) {
+    natural_merge(start + stack.back().begin, start + current.begin,
+                  start + current.end, buffer, min_gallop);
+    current.begin = stack.back().begin;
+    stack.pop_back();
+  }
+}
+
+template <typename Iterator>
+void async_natural_merge_sort_chunks(Iterator start, Iterator end,
+                                     size_t chunks,
+                                     const sort_options &options) {
+  if (chunks < 2) {
+    natural_merge_sort(start, end, options);
+    return;
+  }
+  auto size = size_t(std::distance(start, end));
+  auto middle = start + size * (chunks / 2) / chunks;
+  auto left = scratch_share(options, size_t(middle - start), size);
+  auto right = scratch_share(options, size_t(end - middle), size);
+  sort_pool(options).invoke(
+      [=, &left] {
+        async_natural_merge_sort_chunks(start, middle, chunks / 2, left);
+      },
+      [=, &right] {
+        async_natural_merge_sort_chunks(middle, end, chunks - chunks / 2,
+                                        right);
+      });
+  if (*middle < middle[-1])
+    parallel_inplace_merge(start, middle, end, options);
+}
+
+// natural_merge_sort on one chunk per thread, each with its own run stack,
+// then a parallel merge tree over the chunks. Chunks that are already in
+// order with their neighbour are not merged, so presorted input stays O(n).
+template <typename Iterator>
+void async_natural_merge_sort(
+    Iterator start, Iterator end,
+    const sort_options &options = default_sort_options()) {
+  async_natural_merge_sort_chunks(
+      start, end, sort_chunks(size_t(std::distance(start, end)), options),
+      options);
+}
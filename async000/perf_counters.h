@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct perf_counter_value {
+  std::string name;
+  double value;
+  bool valid; // false if the kernel never scheduled the counter
+};
+
+// Hardware counters of the whole process, read through perf_event_open.
+//
+// perf events follow a single thread, so every counter is opened once per
+// thread in /proc/self/task and the per-thread counts are summed. Threads
+// started later, e.g. by a new pool, are not counted: create the counters
+// after the pool. Counters the kernel or the CPU does not offer (containers,
+// VMs without a PMU, perf_event_paranoid > 2) are left out, and available()
+// is false when none could be opened.
+class perf_counters {
+public:
+  perf_counters() {
+#ifdef __linux__
+    auto tasks = thread_ids();
+    for (auto &&kind : kinds()) {
+      auto counter = event{kind.name, {}};
+      for (auto tid : tasks) {
+        auto fd = open_event(kind.type, kind.config, tid);
+        if (fd < 0) {
+          if (error.empty())
+            error = std::string(kind.name) + ": " + std::strerror(errno);
+          continue;
+        }
+        counter.fds.push_back(fd);
+      }
+      if (!counter.fds.empty())
+        events.push_back(counter);
+    }
+#else
+    error = "perf_event_open needs Linux";
+#endif
+  }
+
+  ~perf_counters() {
+#ifdef __linux__
+    for (auto &&counter : events) {
+      for (auto fd : counter.fds)
+        close(fd);
+    }
+#endif
+  }
+
+  perf_counters(const perf_counters &) = delete;
+  perf_counters &operator=(const perf_counters &) = delete;
+
+  bool available() const { return !events.empty(); }
+
+  // Why the first counter that is missing could not be opened.
+  const std::string &unavailable_reason() const { return error; }
+
+  // Clears and starts all counters.
+  void start() {
+#ifdef __linux__
+    for (auto &&counter : events) {
+      for (auto fd : counter.fds) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  // Stops the counters and returns the counts since start, scaled up when
+  // the kernel had to multiplex them.
+  std::vector<perf_counter_value> stop() {
+    auto values = std::vector<perf_counter_value>();
+#ifdef __linux__
+    for (auto &&counter : events) {
+      for (auto fd : counter.fds)
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (auto &&counter : events) {
+      auto total = perf_counter_value{counter.name, 0, false};
+      for (auto fd : counter.fds) {
+        uint64_t data[3]; // value, time enabled, time running
+        if (read(fd, data, sizeof(data)) != ssize_t(sizeof(data)) ||
+            data[2] == 0)
+          continue;
+        total.value += double(data[0]) * double(data[1]) / double(data[2]);
+        total.valid = true;
+      }
+      values.push_back(total);
+    }
+#endif
+    return values;
+  }
+
+private:
+  struct event {
+    const char *name;
+    std::vector<int> fds;
+  };
+
+  std::vector<event> events;
+  std::string error;
+
+#ifdef __linux__
+  struct kind {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+  };
+
+  static constexpr uint64_t cache_miss(uint64_t cache) {
+    return cache | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+           PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  }
+
+  static std::vector<kind> kinds() {
+    return {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"L1-dcache-misses", PERF_TYPE_HW_CACHE,
+         cache_miss(PERF_COUNT_HW_CACHE_L1D)},
+        {"LLC-misses", PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)},
+        {"dTLB-misses", PERF_TYPE_HW_CACHE,
+         cache_miss(PERF_COUNT_HW_CACHE_DTLB)},
+    };
+  }
+
+  static std::vector<pid_t> thread_ids() {
+    auto tids = std::vector<pid_t>();
+    auto dir = opendir("/proc/self/task");
+    if (!dir)
+      return {pid_t(syscall(SYS_gettid))};
+    while (auto entry = readdir(dir)) {
+      if (entry->d_name[0] != '.')
+        tids.push_back(pid_t(std::stol(entry->d_name)));
+    }
+    closedir(dir);
+    return tids;
+  }
+
+  static int open_event(uint32_t type, uint64_t config, pid_t tid) {
+    auto attr = perf_event_attr();
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return int(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+  }
+#endif
+};
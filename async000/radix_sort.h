@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "sort.h"
+#include "thread_pool.h"
+
+constexpr auto RADIX_BITS = 8u;
+constexpr auto RADIX_BUCKETS = 1u << RADIX_BITS;
+// Smallest number of elements worth a chunk of its own in a parallel pass.
+constexpr auto RADIX_MIN_CHUNK = size_t(1) << 16;
+
+// Maps a value to an unsigned key whose byte-wise order is the value order.
+template <typename T, typename Enable = void> struct radix_traits;
+
+template <typename T>
+struct radix_traits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_unsigned<T>::value>::type> {
+  using key_type = T;
+  static key_type key(T value) { return value; }
+};
+
+// Signed integers: flipping the sign bit moves negatives below positives.
+template <typename T>
+struct radix_traits<
+    T, typename std::enable_if<std::is_integral<T>::value &&
+                               std::is_signed<T>::value>::type> {
+  using key_type = typename std::make_unsigned<T>::type;
+  static key_type key(T value) {
+    return key_type(value) ^ key_type(key_type(1) << (8 * sizeof(T) - 1));
+  }
+};
+
+// IEEE floats: positives get the sign bit set, negatives get all bits
+// flipped so that larger magnitudes sort first.
+template <typename T, typename Key> struct radix_float_traits {
+  static_assert(sizeof(T) == sizeof(Key), "unexpected floating point size");
+  using key_type = Key;
+  static key_type key(T value) {
+    key_type bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    constexpr auto sign = key_type(key_type(1) << (8 * sizeof(Key) - 1));
+    return (bits & sign) ? key_type(~bits) : key_type(bits | sign);
+  }
+};
+
+template <> struct radix_traits<float> : radix_float_traits<float, uint32_t> {};
+template <>
+struct radix_traits<double> : radix_float_traits<double, uint64_t> {};
+
+template <typename T>
+using radix_key_t = typename radix_traits<T>::key_type;
+
+// Digits in the key of T, one per pass.
+template <typename T> constexpr unsigned radix_passes() {
+  return unsigned(sizeof(radix_key_t<T>) * 8 / RADIX_BITS);
+}
+
+template <typename T> unsigned radix_digit(const T &value, unsigned pass) {
+  return unsigned(radix_traits<T>::key(value) >> (pass * RADIX_BITS)) &
+         (RADIX_BUCKETS - 1);
+}
+
+using radix_histogram = std::array<size_t, RADIX_BUCKETS>;
+
+// Number of chunks a pass over size elements is split into.
+inline size_t radix_chunks(size_t size, const thread_pool &pool) {
+  return std::max<size_t>(
+      1, std::min<size_t>(size / RADIX_MIN_CHUNK, pool.concurrency()));
+}
+
+// Write positions of one stable counting pass: every chunk counts its
+// digits, and a prefix sum over (digit, chunk) turns the counts into the
+// first slot of every digit of every chunk, so the chunks scatter to
+// disjoint slots.
+template <typename Input>
+std::vector<radix_histogram> radix_offsets(Input from, size_t size,
+                                           unsigned pass, thread_pool &pool) {
+  auto chunks = radix_chunks(size, pool);
+  auto offsets = std::vector<radix_histogram>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &count = offsets[chunk];
+    count.fill(0);
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      ++count[radix_digit(from[i], pass)];
+  });
+  auto sum = size_t(0);
+  for (auto digit = 0u; digit < RADIX_BUCKETS; ++digit) {
+    for (auto &&count : offsets) {
+      auto n = count[digit];
+      count[digit] = sum;
+      sum += n;
+    }
+  }
+  return offsets;
+}
+
+// One stable counting pass from one array to the other.
+template <typename Input, typename Output>
+void radix_scatter(Input from, size_t size, Output to, unsigned pass,
+                   thread_pool &pool) {
+  auto offsets = radix_offsets(from, size, pass, pool);
+  auto chunks = offsets.size();
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &offset = offsets[chunk];
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks;
+         ++i) {
+      auto &&value = from[i];
+      to[offset[radix_digit(value, pass)]++] = std::move(value);
+    }
+  });
+}
+
+// A counting pass that calls move(i, slot) for every element instead, slot
+// being the position element i goes to, for moving other arrays along.
+template <typename Input, typename Move>
+void radix_scatter_with(Input from, size_t size, unsigned pass,
+                        thread_pool &pool, Move move) {
+  auto offsets = radix_offsets(from, size, pass, pool);
+  auto chunks = offsets.size();
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &offset = offsets[chunk];
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      move(i, offset[radix_digit(from[i], pass)]++);
+  });
+}
+
+// One level of an in-place most significant digit first radix sort
+// (American flag sort): count the digits of the range, swap every element
+// into its bucket, then sort the buckets in parallel on the next digit.
+// Buckets up to the leaf size go to quick_sort instead.
+template <typename Iterator>
+void msd_radix_sort_pass(Iterator start, Iterator end, unsigned pass,
+                         thread_pool &pool, const sort_options &options) {
+  auto size = size_t(std::distance(start, end));
+  if (size <= options.leaf_size) {
+    quick_sort(start, end);
+    return;
+  }
+
+  auto chunks = radix_chunks(size, pool);
+  auto counts = std::vector<radix_histogram>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &count = counts[chunk];
+    count.fill(0);
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      ++count[radix_digit(start[i], pass)];
+  });
+
+  auto heads = radix_histogram();
+  auto tails = radix_histogram();
+  auto sum = size_t(0);
+  for (auto digit = 0u; digit < RADIX_BUCKETS; ++digit) {
+    heads[digit] = sum;
+    for (auto &&count : counts)
+      sum += count[digit];
+    tails[digit] = sum;
+  }
+
+  for (auto digit = 0u; digit < RADIX_BUCKETS; ++digit) {
+    while (heads[digit] < tails[digit]) {
+      auto target = radix_digit(start[heads[digit]], pass);
+      if (target == digit)
+        ++heads[digit];
+      else
+        std::iter_swap(start + heads[digit], start + heads[target]++);
+    }
+  }
+
+  if (pass == 0)
+    return;
+  pool.parallel_for(0, RADIX_BUCKETS, [&](size_t digit) {
+    auto first = digit == 0 ? 0 : tails[digit - 1];
+    msd_radix_sort_pass(start + first, start + tails[digit], pass - 1, pool,
+                        options);
+  });
+}
+
+// Radix sort without the scratch buffer of lsd_radix_sort, for ranges too
+// large to be duplicated in memory.
+template <typename Iterator>
+void msd_radix_sort(Iterator start, Iterator end,
+                    const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  msd_radix_sort_pass(start, end, radix_passes<T>() - 1, sort_pool(options),
+                      options);
+}
+
+// The passes of an LSD radix sort over size elements at start that can be
+// skipped because all keys have the same digit there, from histograms of all
+// digits taken in one read.
+template <typename Iterator,
+          typename T = typename std::iterator_traits<Iterator>::value_type>
+std::array<bool, radix_passes<T>()>
+radix_constant_digits(Iterator start, size_t size, thread_pool &pool) {
+  constexpr auto passes = radix_passes<T>();
+  auto chunks = radix_chunks(size, pool);
+  auto counts = std::vector<std::array<radix_histogram, passes>>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &count = counts[chunk];
+    for (auto &&histogram : count)
+      histogram.fill(0);
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i) {
+      auto key = radix_traits<T>::key(start[i]);
+      for (auto pass = 0u; pass < passes; ++pass)
+        ++count[pass][unsigned(key >> (pass * RADIX_BITS)) &
+                      (RADIX_BUCKETS - 1)];
+    }
+  });
+
+  auto skip = std::array<bool, passes>();
+  for (auto pass = 0u; pass < passes; ++pass) {
+    auto digit = radix_digit(start[0], pass);
+    auto total = size_t(0);
+    for (auto &&count : counts)
+      total += count[pass][digit];
+    skip[pass] = total == size;
+  }
+  return skip;
+}
+
+// Least significant digit first radix sort for integer and floating point
+// keys. Passes alternate between the range and one scratch buffer of the same
+// size; digits that are equal in all keys are skipped. Without the budget for
+// the buffer it is msd_radix_sort.
+template <typename Iterator>
+void lsd_radix_sort(Iterator start, Iterator end,
+                    const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto size = size_t(std::distance(start, end));
+  if (size < 2)
+    return;
+  if (!fits_scratch<T>(size, options)) {
+    msd_radix_sort(start, end, options);
+    return;
+  }
+  auto &pool = sort_pool(options);
+  auto chunks = radix_chunks(size, pool);
+  auto skip = radix_constant_digits(start, size, pool);
+
+  auto buffer = std::vector<T>(size);
+  auto in_buffer = false;
+  for (auto pass = 0u; pass < skip.size(); ++pass) {
+    if (skip[pass])
+      continue;
+    if (in_buffer)
+      radix_scatter(buffer.begin(), size, start, pass, pool);
+    else
+      radix_scatter(start, size, buffer.begin(), pass, pool);
+    in_buffer = !in_buffer;
+  }
+
+  if (in_buffer) {
+    pool.parallel_for(0, chunks, [&](size_t chunk) {
+      std::move(buffer.begin() + size * chunk / chunks,
+                buffer.begin() + size * (chunk + 1) / chunks,
+                start + size * chunk / chunks);
+    });
+  }
+}
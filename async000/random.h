@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// splitmix64 finalizer.
+inline uint64_t mix_key(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// i-th output of the splitmix64 stream seeded with seed. It depends on
+// nothing but seed and i, so threads can generate any part of the sequence
+// on their own and the result does not depend on how it is split.
+inline uint64_t counter_random(uint64_t seed, size_t i) {
+  return mix_key(seed + (uint64_t(i) + 1) * 0x9e3779b97f4a7c15);
+}
+
+// Uniform in [0, 1) with 53 random bits.
+inline double counter_random_real(uint64_t seed, size_t i) {
+  return double(counter_random(seed, i) >> 11) / double(uint64_t(1) << 53);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "sort.h"
+#include "thread_pool.h"
+
+// Sample elements drawn per bucket; more samples give more even buckets.
+constexpr auto SAMPLE_OVERSAMPLING = 32u;
+
+// Parallel sample sort: p - 1 splitters taken from a sorted random sample
+// cut the values into p buckets of about n / p elements. Every thread
+// classifies a chunk of the input and the chunks scatter into a buffer in
+// parallel, so unlike async_quick_sort the very first pass already uses all
+// cores. The buckets are then sorted independently and moved back. Without
+// the budget for the buffer and the bucket indices it is async_quick_sort.
+template <typename Iterator>
+void sample_sort(Iterator start, Iterator end,
+                 const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+
+  auto size = size_t(std::distance(start, end));
+  auto &pool = sort_pool(options);
+  auto buckets = std::min<size_t>(pool.concurrency(), UINT16_MAX);
+  if (size <= options.task_grain || buckets < 2 ||
+      size > options.scratch_budget / (sizeof(T) + sizeof(uint16_t))) {
+    async_quick_sort(start, end, options);
+    return;
+  }
+
+  auto splitters = std::vector<T>();
+  {
+    auto generator = std::mt19937_64(size);
+    auto distribution = std::uniform_int_distribution<size_t>(0, size - 1);
+    auto sample = std::vector<T>(buckets * SAMPLE_OVERSAMPLING);
+    for (auto &&value : sample)
+      value = start[distribution(generator)];
+    std::sort(sample.begin(), sample.end());
+    for (auto i = 1u; i < buckets; ++i)
+      splitters.push_back(sample[i * SAMPLE_OVERSAMPLING]);
+  }
+
+  auto chunks = buckets;
+  auto chunk_begin = [size, chunks](size_t chunk) {
+    return size * chunk / chunks;
+  };
+  auto bucket_of = std::vector<uint16_t>(size);
+  auto offsets = std::vector<std::vector<size_t>>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &count = offsets[chunk];
+    count.assign(buckets, 0);
+    for (auto i = chunk_begin(chunk); i < chunk_begin(chunk + 1); ++i) {
+      auto bucket = std::upper_bound(splitters.begin(), splitters.end(),
+                                     start[i]) -
+                    splitters.begin();
+      bucket_of[i] = uint16_t(bucket);
+      ++count[bucket];
+    }
+  });
+
+  auto bucket_begin = std::vector<size_t>(buckets + 1);
+  auto sum = size_t(0);
+  for (auto bucket = 0u; bucket < buckets; ++bucket) {
+    bucket_begin[bucket] = sum;
+    for (auto &&count : offsets) {
+      auto n = count[bucket];
+      count[bucket] = sum;
+      sum += n;
+    }
+  }
+  bucket_begin[buckets] = sum;
+
+  auto buffer = std::vector<T>(size);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &offset = offsets[chunk];
+    for (auto i = chunk_begin(chunk); i < chunk_begin(chunk + 1); ++i)
+      buffer[offset[bucket_of[i]]++] = std::move(start[i]);
+  });
+
+  // async_quick_sort rather than quick_sort: a bucket swollen by a frequent
+  // value is still split among the threads that finished early. The buckets
+  // share what the buffer and the bucket indices leave of the budget.
+  auto rest = scratch_left(options, size * (sizeof(T) + sizeof(uint16_t)));
+  pool.parallel_for(0, buckets, [&](size_t bucket) {
+    auto first = buffer.begin() + bucket_begin[bucket];
+    auto last = buffer.begin() + bucket_begin[bucket + 1];
+    async_quick_sort(first, last,
+                     scratch_share(rest, size_t(last - first), size));
+    std::move(first, last, start + bucket_begin[bucket]);
+  });
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_SORT_X86 1
+#include <immintrin.h>
+#endif
+
+// Widest vector instruction set the sorting kernels can use on this CPU.
+enum class simd_isa { scalar, avx2, avx512 };
+
+inline simd_isa detect_simd_isa() {
+#ifdef SIMD_SORT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return simd_isa::avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return simd_isa::avx2;
+#endif
+  return simd_isa::scalar;
+}
+
+inline simd_isa simd_level() {
+  static const auto isa = detect_simd_isa();
+  return isa;
+}
+
+// True for iterators over contiguous int32 or float elements, the only ones
+// the kernels handle.
+template <typename Iterator,
+          typename T = typename std::iterator_traits<Iterator>::value_type>
+struct simd_sortable
+    : std::integral_constant<
+          bool,
+          (std::is_same<T, int32_t>::value || std::is_same<T, float>::value) &&
+              (std::is_pointer<Iterator>::value ||
+               std::is_same<Iterator,
+                            typename std::vector<T>::iterator>::value)> {};
+
+// Compare-exchange stages of bitonic sorting networks over W lanes. In every
+// stage lane i is compared with lane partner[i] and keeps the larger value
+// where take_max[i] is -1 (bit i of max_mask), the smaller one otherwise.
+template <unsigned W> struct bitonic_network {
+  struct stage {
+    int32_t partner[W];
+    int32_t take_max[W];
+    uint32_t max_mask;
+  };
+
+  std::vector<stage> sort;  // sorts any vector
+  std::vector<stage> merge; // sorts a bitonic vector
+  int32_t reverse[W];
+
+  static const bitonic_network &get() {
+    static const bitonic_network network;
+    return network;
+  }
+
+private:
+  bitonic_network() {
+    for (auto k = 2u; k <= W; k *= 2) {
+      for (auto j = k / 2; j > 0; j /= 2)
+        sort.push_back(make_stage(k, j));
+    }
+    for (auto j = W / 2; j > 0; j /= 2)
+      merge.push_back(make_stage(W, j));
+    for (auto i = 0u; i < W; ++i)
+      reverse[i] = int32_t(W - 1 - i);
+  }
+
+  // Stage of the bitonic sort that compares lanes j apart within blocks of
+  // k lanes, sorting the blocks alternately up and down.
+  static stage make_stage(unsigned k, unsigned j) {
+    auto result = stage();
+    result.max_mask = 0;
+    for (auto i = 0u; i < W; ++i) {
+      auto partner = i ^ j;
+      auto ascending = (i & k) == 0;
+      auto take_max = (i < partner) != ascending;
+      result.partner[i] = int32_t(partner);
+      result.take_max[i] = take_max ? -1 : 0;
+      result.max_mask |= unsigned(take_max) << i;
+    }
+    return result;
+  }
+};
+
+#ifdef SIMD_SORT_X86
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace simd_avx2 {
+
+constexpr auto W = 8u;
+using network = bitonic_network<W>;
+
+inline __m256i load_index(const int32_t *index) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index));
+}
+
+// For every 8-bit mask of lanes that go right, the permutation that moves the
+// other lanes to the front and those to the back, both in order.
+inline const int32_t *partition_table() {
+  static const auto table = [] {
+    auto result = std::vector<int32_t>(256 * W);
+    for (auto mask = 0u; mask < 256; ++mask) {
+      auto lane = result.begin() + mask * W;
+      for (auto i = 0u; i < W; ++i) {
+        if (!(mask & (1u << i)))
+          *lane++ = int32_t(i);
+      }
+      for (auto i = 0u; i < W; ++i) {
+        if (mask & (1u << i))
+          *lane++ = int32_t(i);
+      }
+    }
+    return result;
+  }();
+  return table.data();
+}
+
+struct int32_ops {
+  using T = int32_t;
+  using V = __m256i;
+  static T padding() { return std::numeric_limits<T>::max(); }
+  static V load(const T *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const V *>(p));
+  }
+  static void store(T *p, V v) {
+    _mm256_storeu_si256(reinterpret_cast<V *>(p), v);
+  }
+  static V set1(T value) { return _mm256_set1_epi32(value); }
+  static V min(V a, V b) { return _mm256_min_epi32(a, b); }
+  static V max(V a, V b) { return _mm256_max_epi32(a, b); }
+  static V permute(V v, __m256i index) {
+    return _mm256_permutevar8x32_epi32(v, index);
+  }
+  static V blend(V low, V high, const network::stage &stage) {
+    return _mm256_blendv_epi8(low, high, load_index(stage.take_max));
+  }
+  static unsigned greater(V v, V pivot) {
+    return unsigned(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, pivot))));
+  }
+  static unsigned greater_equal(V v, V pivot) {
+    return ~unsigned(_mm256_movemask_ps(
+               _mm256_castsi256_ps(_mm256_cmpgt_epi32(pivot, v)))) &
+           0xff;
+  }
+};
+
+struct float_ops {
+  using T = float;
+  using V = __m256;
+  static T padding() { return std::numeric_limits<T>::infinity(); }
+  static V load(const T *p) { return _mm256_loadu_ps(p); }
+  static void store(T *p, V v) { _mm256_storeu_ps(p, v); }
+  static V set1(T value) { return _mm256_set1_ps(value); }
+  static V min(V a, V b) { return _mm256_min_ps(a, b); }
+  static V max(V a, V b) { return _mm256_max_ps(a, b); }
+  static V permute(V v, __m256i index) {
+    return _mm256_permutevar8x32_ps(v, index);
+  }
+  static V blend(V low, V high, const network::stage &stage) {
+    return _mm256_blendv_ps(low, high,
+                            _mm256_castsi256_ps(load_index(stage.take_max)));
+  }
+  static unsigned greater(V v, V pivot) {
+    return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(v, pivot, _CMP_NLE_UQ)));
+  }
+  static unsigned greater_equal(V v, V pivot) {
+    return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(v, pivot, _CMP_NLT_UQ)));
+  }
+};
+
+// AVX2 has no compress: permute the lanes through the table and store the
+// whole vector on both sides, relying on W free slots at either end.
+template <typename Ops>
+void store_partitioned(typename Ops::V v, unsigned right,
+                       typename Ops::T *left, typename Ops::T *right_end) {
+  v = Ops::permute(v, load_index(partition_table() + right * W));
+  Ops::store(left, v);
+  Ops::store(right_end - W, v);
+}
+
+#include "simd_kernels.inc"
+
+} // namespace simd_avx2
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace simd_avx512 {
+
+constexpr auto W = 16u;
+using network = bitonic_network<W>;
+
+inline __m512i load_index(const int32_t *index) {
+  return _mm512_loadu_si512(index);
+}
+
+// The maskz forms avoid _mm512_undefined, which trips -Wuninitialized.
+constexpr auto ALL = __mmask16(0xffff);
+
+struct int32_ops {
+  using T = int32_t;
+  using V = __m512i;
+  static T padding() { return std::numeric_limits<T>::max(); }
+  static V load(const T *p) { return _mm512_loadu_si512(p); }
+  static void store(T *p, V v) { _mm512_storeu_si512(p, v); }
+  static V set1(T value) { return _mm512_set1_epi32(value); }
+  static V min(V a, V b) { return _mm512_maskz_min_epi32(ALL, a, b); }
+  static V max(V a, V b) { return _mm512_maskz_max_epi32(ALL, a, b); }
+  static V permute(V v, __m512i index) {
+    return _mm512_maskz_permutexvar_epi32(ALL, index, v);
+  }
+  static V blend(V low, V high, const network::stage &stage) {
+    return _mm512_mask_blend_epi32(__mmask16(stage.max_mask), low, high);
+  }
+  static unsigned greater(V v, V pivot) {
+    return _mm512_cmpgt_epi32_mask(v, pivot);
+  }
+  static unsigned greater_equal(V v, V pivot) {
+    return _mm512_cmpge_epi32_mask(v, pivot);
+  }
+  static void compress_store(T *p, __mmask16 mask, V v) {
+    _mm512_mask_compressstoreu_epi32(p, mask, v);
+  }
+};
+
+struct float_ops {
+  using T = float;
+  using V = __m512;
+  static T padding() { return std::numeric_limits<T>::infinity(); }
+  static V load(const T *p) { return _mm512_loadu_ps(p); }
+  static void store(T *p, V v) { _mm512_storeu_ps(p, v); }
+  static V set1(T value) { return _mm512_set1_ps(value); }
+  static V min(V a, V b) { return _mm512_maskz_min_ps(ALL, a, b); }
+  static V max(V a, V b) { return _mm512_maskz_max_ps(ALL, a, b); }
+  static V permute(V v, __m512i index) {
+    return _mm512_maskz_permutexvar_ps(ALL, index, v);
+  }
+  static V blend(V low, V high, const network::stage &stage) {
+    return _mm512_mask_blend_ps(__mmask16(stage.max_mask), low, high);
+  }
+  static unsigned greater(V v, V pivot) {
+    return _mm512_cmp_ps_mask(v, pivot, _CMP_NLE_UQ);
+  }
+  static unsigned greater_equal(V v, V pivot) {
+    return _mm512_cmp_ps_mask(v, pivot, _CMP_NLT_UQ);
+  }
+  static void compress_store(T *p, __mmask16 mask, V v) {
+    _mm512_mask_compressstoreu_ps(p, mask, v);
+  }
+};
+
+template <typename Ops>
+void store_partitioned(typename Ops::V v, unsigned right,
+                       typename Ops::T *left, typename Ops::T *right_end) {
+  auto count = __builtin_popcount(right);
+  Ops::compress_store(left, __mmask16(~right), v);
+  Ops::compress_store(right_end - count, __mmask16(right), v);
+}
+
+#include "simd_kernels.inc"
+
+} // namespace simd_avx512
+#pragma GCC pop_options
+
+#endif
+
+// Number of elements simd_block_sort handles; 0 without vector support.
+inline ptrdiff_t simd_block_size(simd_isa isa) {
+  switch (isa) {
+  case simd_isa::avx512:
+    return 32;
+  case simd_isa::avx2:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+// Moves the elements < pivot, or <= pivot if not strict, in front of the
+// others and returns the split.
+template <typename T>
+T *simd_partition(T *start, T *end, T pivot, bool strict, simd_isa isa) {
+  switch (isa) {
+#ifdef SIMD_SORT_X86
+  case simd_isa::avx512:
+    return simd_avx512::partition(start, end, pivot, strict);
+  case simd_isa::avx2:
+    return simd_avx2::partition(start, end, pivot, strict);
+#endif
+  default:
+    if (strict)
+      return std::partition(start, end, [pivot](T v) { return v < pivot; });
+    return std::partition(start, end, [pivot](T v) { return v <= pivot; });
+  }
+}
+
+// Sorts at most simd_block_size(isa) elements with a sorting network.
+template <typename T> void simd_block_sort(T *start, T *end, simd_isa isa) {
+  switch (isa) {
+#ifdef SIMD_SORT_X86
+  case simd_isa::avx512:
+    simd_avx512::block_sort(start, end);
+    return;
+  case simd_isa::avx2:
+    simd_avx2::block_sort(start, end);
+    return;
+#endif
+  default:
+    std::sort(start, end);
+  }
+}
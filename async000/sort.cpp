@@ -1,17 +1,29 @@
 #include <algorithm>
 #include <chrono>
-#include <future>
+#include <cmath>
+#include <functional>
 #include <iomanip>
 #include <iostream>
-#include <iterator>
-#include <limits>
-#include <random>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "benchmark.h"
+#include "counted.h"
+#include "external_sort.h"
+#include "generators.h"
+#include "loser_tree.h"
+#include "mapped_sort.h"
+#include "natural_merge_sort.h"
+#include "radix_sort.h"
+#include "sample_sort.h"
+#include "sort.h"
+#include "sort_by_key.h"
+#include "verify.h"
+
 using namespace std;
 
 constexpr auto NUMBERS_SIZE = size_t(1e7);
-constexpr auto MAX_PART = 1u << 14;
 
 template <typename Iterator> void print(Iterator start, Iterator end) {
   while (start < end) {
@@ -21,149 +33,347 @@ template <typename Iterator> void print(Iterator start, Iterator end) {
   cout << endl;
 }
 
-template <typename Iterator> void merge_sort(Iterator start, Iterator end) {
-  auto size = distance(start, end);
-  if (size <= MAX_PART) {
-    sort(start, end);
-  } else {
-    auto middle = start + size / 2;
-    merge_sort(start, middle);
-    merge_sort(middle, end);
-    inplace_merge(start, middle, end);
-  }
-}
+template <typename Iterator> struct named_sort {
+  string name;
+  function<void(Iterator, Iterator, const sort_options &)> sort;
+  bool parallel;
+};
 
+// The sorts that only compare elements, so they also sort counted keys.
 template <typename Iterator>
-void async_merge_sort(Iterator start, Iterator end) {
-  auto size = distance(start, end);
-  if (size <= MAX_PART) {
-    sort(start, end);
-  } else {
-    auto middle = start + size / 2;
-    auto task1 =
-        async(launch::async, async_merge_sort<Iterator>, start, middle);
-    auto task2 = async(launch::async, async_merge_sort<Iterator>, middle, end);
-    task1.wait();
-    task2.wait();
-    inplace_merge(start, middle, end);
-  }
+vector<named_sort<Iterator>> comparison_sorts() {
+  return {
+      {"std::sort",
+       [](Iterator start, Iterator end, const sort_options &) {
+         sort(start, end);
+       },
+       false},
+      {"merge_sort", merge_sort<Iterator>, false},
+      {"async_merge_sort", async_merge_sort<Iterator>, true},
+      {"pingpong_merge_sort", pingpong_merge_sort<Iterator>, false},
+      {"async_pingpong_merge_sort", async_pingpong_merge_sort<Iterator>, true},
+      {"natural_merge_sort", natural_merge_sort<Iterator>, false},
+      {"async_natural_merge_sort", async_natural_merge_sort<Iterator>, true},
+      {"multiway_merge_sort", multiway_merge_sort<Iterator>, true},
+      {"quick_sort", quick_sort<Iterator>, false},
+      {"async_quick_sort", async_quick_sort<Iterator>, true},
+      {"block_quick_sort", block_quick_sort<Iterator>, false},
+      {"simd_quick_sort", simd_quick_sort<Iterator>, false},
+      {"sample_sort", sample_sort<Iterator>, true},
+  };
 }
 
-template <typename Iterator> void quick_sort(Iterator start, Iterator end) {
-  auto size = distance(start, end);
-  if (size < 2)
-    return;
-  auto pivot = start[size/2];
-  auto head = start;
-  auto tail = end - 1;
-
-  while ((head < end) && (*head == pivot))
-    ++head;
-  if (head == end) {
-    return;
-  }
-  if (*head < pivot) {
-    pivot = *head;
-    head = start;
-  }
-  while (head < tail) {
-    while ((head < tail) && (*head <= pivot))
-      ++head;
-    while ((head < tail) && (*tail > pivot))
-      --tail;
-    if (head >= tail)
-      break;
-    iter_swap(head++, tail--);
-  }
-  if (*head <= pivot)
-    ++head;
-
-  quick_sort<Iterator>(start, head);
-  quick_sort<Iterator>(head, end);
+template <typename Iterator> vector<named_sort<Iterator>> sort_algorithms() {
+  auto algorithms = comparison_sorts<Iterator>();
+  algorithms.insert(algorithms.end() - 1,
+                    {{"lsd_radix_sort", lsd_radix_sort<Iterator>, true},
+                     {"msd_radix_sort", msd_radix_sort<Iterator>, true}});
+  return algorithms;
 }
 
-template <typename Iterator>
-void async_quick_sort(Iterator start, Iterator end) {
-  auto size = distance(start, end);
-  if (size < 2)
-    return;
-  auto pivot = *start;
-  auto head = start;
-  auto tail = end - 1;
-
-  while ((head < end) && (*head == pivot))
-    ++head;
-  if (head == end) {
-    return;
+// Sorts counted copies of numbers with every comparison sort and prints the
+// operations per n * log2(n).
+void print_operation_counts(const vector<int> &numbers,
+                            const benchmark_options &options,
+                            const sort_options &sorting) {
+  using Iterator = vector<counted<int>>::iterator;
+  auto n = double(numbers.size());
+  auto n_log_n = max(n * log2(max(n, 2.0)), 1.0);
+  auto &counts = operation_counts::get();
+  for (auto &&algorithm : comparison_sorts<Iterator>()) {
+    if (!selected(options.algorithms, algorithm.name))
+      continue;
+    auto keys = vector<counted<int>>(numbers.begin(), numbers.end());
+    counts.reset();
+    algorithm.sort(keys.begin(), keys.end(), sorting);
+    cout << setw(26) << algorithm.name << " comparisons "
+         << counts.comparisons / n_log_n << ", copies "
+         << counts.copies / n_log_n << ", moves " << counts.moves / n_log_n
+         << ", swaps " << counts.swaps / n_log_n << " per n log2 n" << endl;
+    if (!is_sorted(keys.begin(), keys.end()))
+      cout << algorithm.name << " sorting failed" << endl;
   }
-  if (*head < pivot) {
-    iter_swap(head, start);
-    head = start + 1;
-    pivot = *start;
+}
+
+// The sort called name on plain arrays, for the sorts of files.
+function<void(int *, int *)> pointer_sort(const string &name,
+                                          const sort_options &sorting) {
+  for (auto &&algorithm : sort_algorithms<int *>()) {
+    if (algorithm.name == name)
+      return [algorithm, &sorting](int *start, int *end) {
+        algorithm.sort(start, end, sorting);
+      };
   }
-  while (head < tail) {
-    while ((head < tail) && (*head <= pivot))
-      ++head;
-    while ((head < tail) && (*tail > pivot))
-      --tail;
-    if (head >= tail)
-      break;
-    iter_swap(head++, tail--);
+  return nullptr;
+}
+
+// A payload of Bytes bytes; the first word names the key it belongs to.
+template <size_t Bytes> struct payload {
+  uint64_t words[Bytes / 8];
+};
+
+template <size_t Bytes> struct record {
+  int64_t key;
+  payload<Bytes> value;
+  bool operator<(const record &other) const { return key < other.key; }
+};
+
+// Times the sort_by_key family on 8-byte keys with Bytes-byte payloads,
+// against std::sort on an array of key and payload records.
+template <size_t Bytes>
+void print_payload_sorts(const vector<int> &numbers,
+                         const benchmark_options &options,
+                         const sort_options &sorting) {
+  using Keys = vector<int64_t>::iterator;
+  using Values = typename vector<payload<Bytes>>::iterator;
+  auto time = [](const string &name, auto sort, auto check) {
+    auto start = chrono::high_resolution_clock::now();
+    sort();
+    auto seconds = chrono::duration<double>(
+                       chrono::high_resolution_clock::now() - start)
+                       .count();
+    cout << setw(26) << name << " " << seconds << "s" << endl;
+    if (!check())
+      cout << name << " sorting failed" << endl;
+  };
+  auto by_key = vector<
+      pair<string, function<void(Keys, Keys, Values, const sort_options &)>>>{
+      {"merge_sort_by_key", merge_sort_by_key<Keys, Values>},
+      {"quick_sort_by_key", quick_sort_by_key<Keys, Values>},
+      {"radix_sort_by_key", radix_sort_by_key<Keys, Values>},
+  };
+
+  if (selected(options.algorithms, "std::sort")) {
+    auto records = vector<record<Bytes>>(numbers.size());
+    for (auto i = size_t(0); i < numbers.size(); ++i)
+      records[i].key = records[i].value.words[0] = numbers[i];
+    time("std::sort of records", [&] { sort(records.begin(), records.end()); },
+         [&] { return is_sorted(records.begin(), records.end()); });
   }
-  if (*head <= pivot)
-    ++head;
-
-  if (size <= MAX_PART) {
-    quick_sort<Iterator>(start, head);
-    quick_sort<Iterator>(head, end);
-  } else {
-    auto task1 = async(launch::async, async_quick_sort<Iterator>, start, head);
-    auto task2 = async(launch::async, async_quick_sort<Iterator>, head, end);
-    task1.wait();
-    task2.wait();
+  for (auto &&algorithm : by_key) {
+    if (!selected(options.algorithms, algorithm.first))
+      continue;
+    auto keys = vector<int64_t>(numbers.begin(), numbers.end());
+    auto values = vector<payload<Bytes>>(numbers.size());
+    for (auto i = size_t(0); i < numbers.size(); ++i)
+      values[i].words[0] = uint64_t(keys[i]);
+    time(algorithm.first,
+         [&] {
+           algorithm.second(keys.begin(), keys.end(), values.begin(), sorting);
+         },
+         [&] {
+           for (auto i = size_t(0); i < keys.size(); ++i) {
+             if (values[i].words[0] != uint64_t(keys[i]))
+               return false;
+           }
+           return is_sorted(keys.begin(), keys.end());
+         });
   }
 }
 
-int main() {
-  auto numbers = vector<int>(NUMBERS_SIZE);
+// Sorts the keys in the file input into output with external_sort, forming
+// the runs with run_sort.
+void sort_file(const function<void(int *, int *)> &run_sort,
+               const string &input, const string &output,
+               const benchmark_options &options, size_t input_bytes) {
+  auto external = external_sort_options();
+  external.memory_budget =
+      options.memory_budget ? options.memory_budget : input_bytes / 4;
+  external.temp_dir = options.temp_dir;
+  external.direct_io = options.direct_io;
+  external.use_io_uring = options.use_io_uring;
+  external_sort<int>(input, output, external, run_sort);
+}
 
-  {
-    uniform_int_distribution<> distribution(numeric_limits<int>::min(),
-                                            numeric_limits<int>::max());
-    //    uniform_int_distribution<> distribution(-10, 10);
-    auto generator = mt19937(0);
-    for (auto &&n : numbers) {
-      n = distribution(generator);
-    }
+int main(int argc, char **argv) {
+  using Iterator = vector<int>::iterator;
+  auto options = benchmark_options();
+  try {
+    options = parse_benchmark_options(argc, argv, NUMBERS_SIZE);
+  } catch (const invalid_argument &error) {
+    cerr << error.what() << endl << BENCHMARK_USAGE;
+    return 1;
   }
-  auto reference = numbers;
-  sort(reference.begin(), reference.end());
+  // Both cutoffs given override the whole profile, so it is neither read nor
+  // measured unless --retune asks for it to be rewritten.
+  auto overridden = options.leaf_size && options.task_grain;
+  auto tuned = false;
+  if (!overridden || options.retune)
+    tuned = load_or_tune_cutoffs(options.profile_file, options.retune);
+  auto sorting = default_sort_options();
+  if (options.leaf_size)
+    sorting.leaf_size = options.leaf_size;
+  if (options.task_grain)
+    sorting.task_grain = options.task_grain;
+  sorting.max_threads = options.max_threads;
+  sorting.scratch_budget = options.scratch_budget;
+  cout << "leaf size " << sorting.leaf_size << ", task grain "
+       << sorting.task_grain;
+  if (overridden)
+    cout << " (given)" << endl;
+  else
+    cout << " (profile " << options.profile_file
+         << (tuned ? ", just tuned)" : ")") << endl;
 
-  auto test = [&numbers, &reference](const string &name, auto sort_function) {
-    auto copy = numbers;
-    auto start = chrono::high_resolution_clock::now();
+  auto numbers = vector<int>();
+  auto input_hash = multiset_hash();
+  auto filled = false;
+  auto results = vector<measurement>();
+  auto pid = to_string(getpid());
+  auto input_file = options.temp_dir + "/sort-input-" + pid;
+  auto output_file = options.temp_dir + "/sort-output-" + pid;
 
-    sort_function(copy.begin(), copy.end());
+  auto counters_warned = false;
+  auto test = [&numbers, &input_hash, &options, &output_file,
+               &counters_warned](const string &name, auto sort_function) {
+    auto counters = unique_ptr<perf_counters>(
+        options.counters ? new perf_counters : nullptr);
+    if (counters && !counters->available()) {
+      if (!counters_warned)
+        cerr << "performance counters unavailable: "
+             << counters->unavailable_reason() << endl;
+      counters_warned = true;
+      counters.reset();
+    }
+    auto counts = vector<perf_counter_value>();
+    auto samples = vector<double>();
+    auto verified = true;
+    for (auto run = size_t(0); run < options.warmup + options.repetitions;
+         ++run) {
+      auto copy = numbers;
+      if (options.mapped) {
+        auto file = unique_fd(output_file, O_WRONLY | O_CREAT | O_TRUNC);
+        write_at(file.get(), copy.data(), copy.size() * sizeof(int), 0);
+      }
+      auto timed = run >= options.warmup;
+      if (counters && timed)
+        counters->start();
+      auto start = chrono::high_resolution_clock::now();
 
-    auto end = chrono::high_resolution_clock::now();
-    auto seconds = chrono::duration<double>(end - start).count();
-    cout << setw(20) << name << " " << seconds << "s" << endl;
-    if (copy != reference) {
-      cout << name << " sorting failed" << endl;
-      std::copy(copy.begin(), copy.end(),
-                std::ostream_iterator<int>(std::cout, " "));
-      cout << endl;
-      cout << "reference" << endl;
-      std::copy(reference.begin(), reference.end(),
-                std::ostream_iterator<int>(std::cout, " "));
-      cout << endl;
+      sort_function(copy.begin(), copy.end());
+
+      auto end = chrono::high_resolution_clock::now();
+      if (counters && timed)
+        accumulate_counters(counts, counters->stop());
+      if (timed)
+        samples.push_back(chrono::duration<double>(end - start).count());
+      if (options.external || options.mapped) {
+        auto file = unique_fd(output_file, O_RDONLY);
+        read_at(file.get(), copy.data(), copy.size() * sizeof(int), 0);
+      }
+      auto check = verify_sorted(copy.begin(), copy.end(), input_hash);
+      if (!check.ok()) {
+        print_verification_failure(cout, name, check, copy.begin());
+        verified = false;
+        break;
+      }
+    }
+    auto result = measurement();
+    result.verified = verified;
+    // A failed warmup run leaves no samples to summarize.
+    if (!samples.empty()) {
+      result.time = summarize(samples);
+      result.seconds = result.time.median;
+      for (auto &&count : counts)
+        count.value /= double(samples.size()) * double(numbers.size());
     }
+    result.counters = counts;
+
+    cout << setw(26) << name;
+    if (!samples.empty())
+      cout << " " << result.time.median << "s";
+    if (samples.size() > 1)
+      cout << " (min " << result.time.min << "s, p95 " << result.time.p95
+           << "s, stddev " << result.time.stddev << "s)";
+    if (!verified)
+      cout << " failed verification";
+    cout << endl;
+    if (!counts.empty())
+      cout << setw(26) << "per element" << " " << format_counters(counts)
+           << endl;
+    return result;
   };
-  test("std::sort", sort<decltype(numbers.begin())>);
-  test("merge_sort", merge_sort<decltype(numbers.begin())>);
-  test("async_merge_sort", async_merge_sort<decltype(numbers.begin())>);
-  test("quick_sort", quick_sort<decltype(numbers.begin())>);
-  test("async_quick_sort", async_quick_sort<decltype(numbers.begin())>);
 
+  for (auto size : options.sizes) {
+    for (auto &&distribution : input_distributions()) {
+      if (!selected(options.distributions, distribution.name))
+        continue;
+      for (auto threads : options.threads) {
+        auto n = options.weak_scaling
+                     ? size * threads / options.threads.front()
+                     : size;
+        set_default_concurrency(threads);
+        if (numbers.size() != n || !filled) {
+          numbers.resize(n);
+          distribution.fill(numbers);
+          input_hash = hash_multiset(numbers.begin(), numbers.end());
+          filled = true;
+          if (options.external) {
+            auto file = unique_fd(input_file, O_WRONLY | O_CREAT | O_TRUNC);
+            write_at(file.get(), numbers.data(), n * sizeof(int), 0);
+          }
+        }
+
+        cout << distribution.name << " n=" << n << " threads=" << threads
+             << endl;
+        if (options.count_operations) {
+          print_operation_counts(numbers, options, sorting);
+          continue;
+        }
+        if (options.payload) {
+          if (options.payload == 8)
+            print_payload_sorts<8>(numbers, options, sorting);
+          else if (options.payload == 16)
+            print_payload_sorts<16>(numbers, options, sorting);
+          else if (options.payload == 32)
+            print_payload_sorts<32>(numbers, options, sorting);
+          else
+            print_payload_sorts<64>(numbers, options, sorting);
+          continue;
+        }
+        for (auto &&algorithm : sort_algorithms<Iterator>()) {
+          if (!selected(options.algorithms, algorithm.name))
+            continue;
+          auto result = measurement();
+          auto run_sort = pointer_sort(algorithm.name, sorting);
+          if (options.external) {
+            result = test(algorithm.name, [&](Iterator, Iterator) {
+              sort_file(run_sort, input_file, output_file, options,
+                        n * sizeof(int));
+            });
+          } else if (options.mapped) {
+            result = test(algorithm.name, [&](Iterator, Iterator) {
+              sort_mapped_file<int>(output_file, run_sort);
+            });
+          } else {
+            result = test(algorithm.name,
+                          [&algorithm, &sorting](Iterator start,
+                                                 Iterator end) {
+                            algorithm.sort(start, end, sorting);
+                          });
+          }
+          result.distribution = distribution.name;
+          result.algorithm = algorithm.name;
+          result.parallel = algorithm.parallel;
+          result.size = n;
+          result.threads = threads;
+          results.push_back(result);
+        }
+      }
+      filled = false;
+    }
+  }
+
+  if (options.external || options.mapped) {
+    unlink(input_file.c_str());
+    unlink(output_file.c_str());
+  }
+  if (!results.empty() &&
+      (options.sizes.size() > 1 || options.threads.size() > 1))
+    print_scaling_report(results, options, "std::sort");
+  if (!options.json_file.empty())
+    write_json(results, options, options.json_file);
+  if (!options.csv_file.empty())
+    write_csv(results, options, options.csv_file);
   return 0;
 }
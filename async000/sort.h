@@ -0,0 +1,612 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "simd_sort.h"
+#include "thread_pool.h"
+
+// Runtime settings every sort accepts. The leaf size depends on the cache
+// sizes, the task grain on the core count; tuning.h measures both.
+struct sort_options {
+  // The merge sorts hand ranges up to this size to leaf_sort, msd_radix_sort
+  // hands buckets to quick_sort.
+  size_t leaf_size = size_t(1) << 14;
+  // The parallel sorts stop spawning tasks for ranges up to this size and
+  // sort them sequentially.
+  size_t task_grain = size_t(1) << 14;
+  // Threads a parallel sort may use, 0 for all of the default pool.
+  unsigned max_threads = 0;
+  // Bytes of scratch memory a sort may hold at once, summed over all of its
+  // tasks. Sorts that would need more fall back to an in-place method.
+  size_t scratch_budget = SIZE_MAX;
+};
+
+// Options of the calls that pass none.
+inline sort_options &default_sort_options() {
+  static auto options = sort_options();
+  return options;
+}
+
+inline thread_pool &sort_pool(const sort_options &options) {
+  return options.max_threads ? pool_for(options.max_threads) : default_pool();
+}
+
+// Chunks a parallel pass over size elements is cut into: one per thread of
+// the sort, none smaller than the task grain, at least one.
+inline size_t sort_chunks(size_t size, const sort_options &options) {
+  return std::max<size_t>(
+      std::min<size_t>(sort_pool(options).concurrency(),
+                       size / options.task_grain),
+      1);
+}
+
+template <typename T>
+bool fits_scratch(size_t elements, const sort_options &options) {
+  return elements <= options.scratch_budget / sizeof(T);
+}
+
+// Options for a part of part elements out of whole that is sorted at the
+// same time as the other parts. Its share of the scratch budget is in
+// proportion to its size, so the parts together stay within the budget and
+// each still gets as much as a sort of its size needs whenever the whole
+// range would have.
+inline sort_options scratch_share(const sort_options &options, size_t part,
+                                  size_t whole) {
+  auto share = options;
+  if (options.scratch_budget != SIZE_MAX && part < whole)
+    share.scratch_budget = size_t(double(options.scratch_budget) *
+                                  double(part) / double(whole));
+  return share;
+}
+
+// Options for what runs while bytes of scratch are already held: the rest of
+// the budget, nothing when those bytes alone exceed it.
+inline sort_options scratch_left(const sort_options &options, size_t bytes) {
+  auto left = options;
+  if (options.scratch_budget != SIZE_MAX)
+    left.scratch_budget -= std::min(bytes, options.scratch_budget);
+  return left;
+}
+
+template <typename Iterator> void leaf_sort(Iterator start, Iterator end);
+
+// Number of elements the first k outputs of merging a[0, m) with b[0, n)
+// take from a, ties going to a as in std::merge. Found by binary search on
+// the diagonal k of the merge path.
+template <typename Iterator1, typename Iterator2>
+size_t co_rank(size_t k, Iterator1 a, size_t m, Iterator2 b, size_t n) {
+  auto low = k > n ? k - n : 0;
+  auto high = std::min(k, m);
+  while (low < high) {
+    auto i = low + (high - low) / 2;
+    if (b[k - i - 1] < a[i])
+      high = i;
+    else
+      low = i + 1;
+  }
+  return low;
+}
+
+// Moves the merge of two sorted ranges to out. The output is cut into one
+// segment per thread; co_rank finds where each segment starts in both
+// inputs, so the segments are merged independently.
+template <typename Iterator1, typename Iterator2, typename Output>
+void parallel_merge(Iterator1 first1, Iterator1 last1, Iterator2 first2,
+                    Iterator2 last2, Output out,
+                    const sort_options &options = default_sort_options()) {
+  auto m = size_t(std::distance(first1, last1));
+  auto n = size_t(std::distance(first2, last2));
+  auto &pool = sort_pool(options);
+  auto pieces =
+      std::min<size_t>(pool.concurrency(), (m + n) / options.task_grain);
+  if (pieces < 2) {
+    std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+               std::make_move_iterator(first2), std::make_move_iterator(last2),
+               out);
+    return;
+  }
+  pool.parallel_for(0, pieces, [&](size_t piece) {
+    auto k0 = (m + n) * piece / pieces;
+    auto k1 = (m + n) * (piece + 1) / pieces;
+    auto i0 = co_rank(k0, first1, m, first2, n);
+    auto i1 = co_rank(k1, first1, m, first2, n);
+    std::merge(std::make_move_iterator(first1 + i0),
+               std::make_move_iterator(first1 + i1),
+               std::make_move_iterator(first2 + (k0 - i0)),
+               std::make_move_iterator(first2 + (k1 - i1)), out + k0);
+  });
+}
+
+// std::inplace_merge without a buffer: the larger half is cut in the
+// middle, the other one where that element belongs, and the two inner parts
+// swap places with a rotation before both sides are merged recursively.
+template <typename Iterator>
+void rotate_merge(Iterator start, Iterator middle, Iterator end) {
+  auto left = std::distance(start, middle);
+  auto right = std::distance(middle, end);
+  if (left == 0 || right == 0)
+    return;
+  if (left + right == 2) {
+    if (*middle < *start)
+      std::iter_swap(start, middle);
+    return;
+  }
+  auto cut1 = start;
+  auto cut2 = middle;
+  if (left > right) {
+    cut1 = start + left / 2;
+    cut2 = std::lower_bound(middle, end, *cut1);
+  } else {
+    cut2 = middle + right / 2;
+    cut1 = std::upper_bound(start, middle, *cut2);
+  }
+  auto new_middle = std::rotate(cut1, middle, cut2);
+  rotate_merge(start, cut1, new_middle);
+  rotate_merge(new_middle, cut2, end);
+}
+
+// std::inplace_merge, or rotate_merge if the buffer std::inplace_merge
+// allocates, half the range, exceeds the scratch budget.
+template <typename Iterator>
+void budget_inplace_merge(Iterator start, Iterator middle, Iterator end,
+                          const sort_options &options) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  if (fits_scratch<T>((std::distance(start, end) + 1) / 2, options))
+    std::inplace_merge(start, middle, end);
+  else
+    rotate_merge(start, middle, end);
+}
+
+// std::inplace_merge for large ranges: parallel_merge into a temporary
+// buffer, then move back in parallel.
+template <typename Iterator>
+void parallel_inplace_merge(Iterator start, Iterator middle, Iterator end,
+                            const sort_options &options) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto size = size_t(std::distance(start, end));
+  auto &pool = sort_pool(options);
+  auto pieces =
+      std::min<size_t>(pool.concurrency(), size / options.task_grain);
+  if (pieces < 2 || !fits_scratch<T>(size, options)) {
+    budget_inplace_merge(start, middle, end, options);
+    return;
+  }
+  auto merged = std::vector<T>(size);
+  parallel_merge(start, middle, middle, end, merged.begin(), options);
+  pool.parallel_for(0, pieces, [&](size_t piece) {
+    std::move(merged.begin() + size * piece / pieces,
+              merged.begin() + size * (piece + 1) / pieces,
+              start + size * piece / pieces);
+  });
+}
+
+template <typename Iterator>
+void merge_sort(Iterator start, Iterator end,
+                const sort_options &options = default_sort_options()) {
+  auto size = size_t(std::distance(start, end));
+  if (size <= options.leaf_size) {
+    leaf_sort(start, end);
+  } else {
+    auto middle = start + size / 2;
+    merge_sort(start, middle, options);
+    merge_sort(middle, end, options);
+    budget_inplace_merge(start, middle, end, options);
+  }
+}
+
+template <typename Iterator>
+void async_merge_sort(Iterator start, Iterator end,
+                      const sort_options &options = default_sort_options()) {
+  auto size = size_t(std::distance(start, end));
+  if (size <= options.task_grain) {
+    merge_sort(start, end, options);
+  } else {
+    auto middle = start + size / 2;
+    auto left = scratch_share(options, size / 2, size);
+    auto right = scratch_share(options, size - size / 2, size);
+    sort_pool(options).invoke(
+        [=, &left] { async_merge_sort(start, middle, left); },
+        [=, &right] { async_merge_sort(middle, end, right); });
+    parallel_inplace_merge(start, middle, end, options);
+  }
+}
+
+// Sorts [start, end) using the equally sized range at buffer as scratch and
+// leaves the result in the buffer if to_buffer is set, otherwise in place.
+// The halves are sorted into the other array, so every level merges from one
+// array into the other and nothing is allocated or copied back.
+template <typename Iterator, typename Buffer>
+void pingpong_merge_sort_to(Iterator start, Iterator end, Buffer buffer,
+                            bool to_buffer, const sort_options &options) {
+  auto size = size_t(std::distance(start, end));
+  if (size <= options.leaf_size) {
+    leaf_sort(start, end);
+    if (to_buffer)
+      std::move(start, end, buffer);
+    return;
+  }
+  auto half = size / 2;
+  auto middle = start + half;
+  pingpong_merge_sort_to(start, middle, buffer, !to_buffer, options);
+  pingpong_merge_sort_to(middle, end, buffer + half, !to_buffer, options);
+  if (to_buffer)
+    std::merge(std::make_move_iterator(start), std::make_move_iterator(middle),
+               std::make_move_iterator(middle), std::make_move_iterator(end),
+               buffer);
+  else
+    std::merge(std::make_move_iterator(buffer),
+               std::make_move_iterator(buffer + half),
+               std::make_move_iterator(buffer + half),
+               std::make_move_iterator(buffer + size), start);
+}
+
+// merge_sort with a single scratch buffer allocated up front instead of one
+// allocation per std::inplace_merge. Without the budget for the buffer it is
+// merge_sort.
+template <typename Iterator>
+void pingpong_merge_sort(
+    Iterator start, Iterator end,
+    const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto size = size_t(std::distance(start, end));
+  if (!fits_scratch<T>(size, options)) {
+    merge_sort(start, end, options);
+    return;
+  }
+  auto buffer = std::vector<T>(size);
+  pingpong_merge_sort_to(start, end, buffer.begin(), false, options);
+}
+
+template <typename Iterator, typename Buffer>
+void async_pingpong_merge_sort_to(Iterator start, Iterator end,
+                                  Buffer buffer, bool to_buffer,
+                                  const sort_options &options) {
+  auto size = size_t(std::distance(start, end));
+  if (size <= options.task_grain) {
+    pingpong_merge_sort_to(start, end, buffer, to_buffer, options);
+    return;
+  }
+  auto half = size / 2;
+  auto middle = start + half;
+  sort_pool(options).invoke(
+      [=, &options] {
+        async_pingpong_merge_sort_to(start, middle, buffer, !to_buffer,
+                                     options);
+      },
+      [=, &options] {
+        async_pingpong_merge_sort_to(middle, end, buffer + half, !to_buffer,
+                                     options);
+      });
+  if (to_buffer)
+    parallel_merge(start, middle, middle, end, buffer, options);
+  else
+    parallel_merge(buffer, buffer + half, buffer + half, buffer + size, start,
+                   options);
+}
+
+template <typename Iterator>
+void async_pingpong_merge_sort(
+    Iterator start, Iterator end,
+    const sort_options &options = default_sort_options()) {
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto size = size_t(std::distance(start, end));
+  if (!fits_scratch<T>(size, options)) {
+    async_merge_sort(start, end, options);
+    return;
+  }
+  auto buffer = std::vector<T>(size);
+  async_pingpong_merge_sort_to(start, end, buffer.begin(), false, options);
+}
+
+// Largest k with 2^k <= n.
+inline unsigned log2_floor(size_t n) {
+  auto k = 0u;
+  while (n >>= 1)
+    ++k;
+  return k;
+}
+
+// Recursion depth after which the quicksorts give up on their pivots.
+inline unsigned depth_limit(size_t size) { return 2 * log2_floor(size | 1); }
+
+template <typename Iterator>
+Iterator median_of_three(Iterator a, Iterator b, Iterator c) {
+  if (*a < *b)
+    return *b < *c ? b : (*a < *c ? c : a);
+  return *a < *c ? a : (*b < *c ? c : b);
+}
+
+// Median of three for small ranges, Tukey's ninther for larger ones. Sorted,
+// reversed and organ-pipe inputs all get a pivot close to the median.
+template <typename Iterator>
+Iterator choose_pivot(Iterator start, Iterator end) {
+  auto size = std::distance(start, end);
+  auto middle = start + size / 2;
+  auto last = end - 1;
+  if (size < 128)
+    return median_of_three(start, middle, last);
+  auto step = size / 8;
+  return median_of_three(
+      median_of_three(start, start + step, start + 2 * step),
+      median_of_three(middle - step, middle, middle + step),
+      median_of_three(last - 2 * step, last - step, last));
+}
+
+// How a two-way partition around a pivot taken from the range splits it into
+// two non-empty parts: the elements < pivot go left if some element is
+// smaller than the pivot, the elements <= pivot otherwise. No split is
+// needed when all elements are equal. The pivot itself is kept either way.
+enum class pivot_split { less, less_equal, none };
+
+template <typename Iterator, typename T>
+pivot_split choose_split(Iterator start, Iterator end, const T &pivot) {
+  for (auto head = start; head < end; ++head) {
+    if (*head < pivot)
+      return pivot_split::less;
+    if (pivot < *head)
+      return pivot_split::less_equal;
+  }
+  return pivot_split::none;
+}
+
+// Splits [start, end) into the elements < pivot, == pivot and > pivot and
+// returns the bounds of the middle part (Bentley-McIlroy). Equal elements
+// met by the Hoare scan are parked at both ends and swapped into the middle
+// at the end, so a run of equal keys is settled in one pass and never looked
+// at again. The pivot must be one of the elements.
+template <typename Iterator, typename T>
+std::pair<Iterator, Iterator> partition_three_way(Iterator start,
+                                                  Iterator end, T pivot) {
+  auto size = std::distance(start, end);
+  auto equal_left = decltype(size)(0);
+  auto head = equal_left;
+  auto tail = size - 1;
+  auto equal_right = tail;
+
+  for (;;) {
+    while ((head <= tail) && !(pivot < start[head])) {
+      if (start[head] == pivot)
+        std::iter_swap(start + equal_left++, start + head);
+      ++head;
+    }
+    while ((head <= tail) && !(start[tail] < pivot)) {
+      if (start[tail] == pivot)
+        std::iter_swap(start + tail, start + equal_right--);
+      --tail;
+    }
+    if (head > tail)
+      break;
+    std::iter_swap(start + head++, start + tail--);
+  }
+
+  auto less = head - equal_left;
+  auto greater = equal_right - tail;
+  auto moved = std::min(equal_left, less);
+  std::swap_ranges(start, start + moved, start + head - moved);
+  moved = std::min(greater, size - 1 - equal_right);
+  std::swap_ranges(start + head, start + head + moved, end - moved);
+  return {start + less, end - greater};
+}
+
+// Elements classified per side and round of block_partition.
+constexpr auto PARTITION_BLOCK = 128u;
+
+// Moves the elements for which goes_left holds in front of the others and
+// returns the split, without data-dependent branches (BlockQuicksort). Each
+// round classifies a block at either end, recording the offsets of the
+// elements on the wrong side with an unconditional store and a counter
+// increment, then swaps as many pairs as both blocks have. The last
+// 2 * PARTITION_BLOCK elements are partitioned conventionally.
+template <typename Iterator, typename Predicate>
+Iterator block_partition(Iterator start, Iterator end, Predicate goes_left) {
+  auto left = start;
+  unsigned char offsets_left[PARTITION_BLOCK];
+  unsigned char offsets_right[PARTITION_BLOCK];
+  auto right = end;
+  auto count_left = 0u;
+  auto count_right = 0u;
+  auto first_left = 0u;
+  auto first_right = 0u;
+
+  while (right - left >= 2 * PARTITION_BLOCK) {
+    if (count_left == 0) {
+      first_left = 0;
+      for (auto i = 0u; i < PARTITION_BLOCK; ++i) {
+        offsets_left[count_left] = static_cast<unsigned char>(i);
+        count_left += !goes_left(left[i]);
+      }
+    }
+    if (count_right == 0) {
+      first_right = 0;
+      for (auto i = 0u; i < PARTITION_BLOCK; ++i) {
+        offsets_right[count_right] = static_cast<unsigned char>(i);
+        count_right += goes_left(right[-1 - ptrdiff_t(i)]);
+      }
+    }
+    auto swaps = std::min(count_left, count_right);
+    for (auto i = 0u; i < swaps; ++i) {
+      std::iter_swap(left + offsets_left[first_left + i],
+                     right - 1 - offsets_right[first_right + i]);
+    }
+    count_left -= swaps;
+    count_right -= swaps;
+    first_left += swaps;
+    first_right += swaps;
+    if (count_left == 0)
+      left += PARTITION_BLOCK;
+    if (count_right == 0)
+      right -= PARTITION_BLOCK;
+  }
+  return std::partition(left, right, goes_left);
+}
+
+template <typename Iterator> void heap_sort(Iterator start, Iterator end) {
+  std::make_heap(start, end);
+  std::sort_heap(start, end);
+}
+
+// Introsort: once the recursion is deeper than depth, the pivots are failing
+// and the range is finished with heap_sort, which is O(n log n) on any input.
+template <typename Iterator>
+void quick_sort_limited(Iterator start, Iterator end, unsigned depth) {
+  auto size = std::distance(start, end);
+  if (size < 2)
+    return;
+  if (depth == 0) {
+    heap_sort(start, end);
+    return;
+  }
+  auto equal = partition_three_way(start, end, *choose_pivot(start, end));
+  quick_sort_limited(start, equal.first, depth - 1);
+  quick_sort_limited(equal.second, end, depth - 1);
+}
+
+// The options do not apply: quick_sort is sequential and in place.
+template <typename Iterator>
+void quick_sort(Iterator start, Iterator end,
+                const sort_options & = default_sort_options()) {
+  quick_sort_limited(start, end, depth_limit(std::distance(start, end)));
+}
+
+template <typename Iterator>
+void block_quick_sort_limited(Iterator start, Iterator end, unsigned depth) {
+  auto size = std::distance(start, end);
+  if (size < 2)
+    return;
+  if (depth == 0) {
+    heap_sort(start, end);
+    return;
+  }
+  using T = typename std::iterator_traits<Iterator>::value_type;
+  auto pivot = T(*choose_pivot(start, end));
+  auto head = end;
+  switch (choose_split(start, end, pivot)) {
+  case pivot_split::none:
+    return;
+  case pivot_split::less:
+    head = block_partition(start, end,
+                           [&pivot](const T &value) { return value < pivot; });
+    break;
+  case pivot_split::less_equal:
+    head = block_partition(
+        start, end, [&pivot](const T &value) { return !(pivot < value); });
+    break;
+  }
+
+  block_quick_sort_limited(start, head, depth - 1);
+  block_quick_sort_limited(head, end, depth - 1);
+}
+
+// quick_sort on block_partition, for inputs where the branches of the
+// partition loop are unpredictable, such as random keys.
+template <typename Iterator>
+void block_quick_sort(Iterator start, Iterator end,
+                      const sort_options & = default_sort_options()) {
+  block_quick_sort_limited(start, end, depth_limit(std::distance(start, end)));
+}
+
+// Same as quick_sort_limited, but falls back to async_merge_sort so that a
+// bad input stays parallel.
+template <typename Iterator>
+void async_quick_sort_limited(Iterator start, Iterator end, unsigned depth,
+                              const sort_options &options) {
+  auto size = size_t(std::distance(start, end));
+  if (size <= options.task_grain) {
+    quick_sort_limited(start, end, depth);
+    return;
+  }
+  if (depth == 0) {
+    async_merge_sort(start, end, options);
+    return;
+  }
+  auto equal = partition_three_way(start, end, *choose_pivot(start, end));
+  auto less_end = equal.first;
+  auto greater_start = equal.second;
+  auto less = scratch_share(options, size_t(less_end - start), size);
+  auto greater = scratch_share(options, size_t(end - greater_start), size);
+  sort_pool(options).invoke(
+      [=, &less] {
+        async_quick_sort_limited(start, less_end, depth - 1, less);
+      },
+      [=, &greater] {
+        async_quick_sort_limited(greater_start, end, depth - 1, greater);
+      });
+}
+
+template <typename Iterator>
+void async_quick_sort(Iterator start, Iterator end,
+                      const sort_options &options = default_sort_options()) {
+  async_quick_sort_limited(start, end, depth_limit(std::distance(start, end)),
+                           options);
+}
+
+// quick_sort on the vector kernels of simd_sort.h: simd_partition splits the
+// ranges and simd_block_sort finishes the ones that fit in two registers.
+template <typename T>
+void simd_quick_sort_limited(T *start, T *end, unsigned depth, simd_isa isa) {
+  while (end - start > simd_block_size(isa)) {
+    if (depth == 0) {
+      heap_sort(start, end);
+      return;
+    }
+    --depth;
+    auto pivot = *choose_pivot(start, end);
+    auto split = choose_split(start, end, pivot);
+    if (split == pivot_split::none)
+      return;
+    auto head =
+        simd_partition(start, end, pivot, split == pivot_split::less, isa);
+    simd_quick_sort_limited(start, head, depth, isa);
+    start = head;
+  }
+  simd_block_sort(start, end, isa);
+}
+
+template <typename Iterator>
+void simd_quick_sort_dispatch(Iterator start, Iterator end, std::true_type) {
+  auto size = std::distance(start, end);
+  auto isa = simd_level();
+  if (size < 2 || isa == simd_isa::scalar) {
+    quick_sort(start, end);
+    return;
+  }
+  auto first = &*start;
+  simd_quick_sort_limited(first, first + size, depth_limit(size), isa);
+}
+
+template <typename Iterator>
+void simd_quick_sort_dispatch(Iterator start, Iterator end, std::false_type) {
+  quick_sort(start, end);
+}
+
+// Vectorised quick_sort for int32 and float ranges, using the widest
+// instruction set the CPU supports. Other ranges go to quick_sort.
+template <typename Iterator>
+void simd_quick_sort(Iterator start, Iterator end,
+                     const sort_options & = default_sort_options()) {
+  simd_quick_sort_dispatch(start, end, simd_sortable<Iterator>());
+}
+
+template <typename Iterator>
+void leaf_sort_dispatch(Iterator start, Iterator end, std::true_type) {
+  if (simd_level() == simd_isa::scalar)
+    std::sort(start, end);
+  else
+    simd_quick_sort(start, end);
+}
+
+template <typename Iterator>
+void leaf_sort_dispatch(Iterator start, Iterator end, std::false_type) {
+  std::sort(start, end);
+}
+
+// Sequential sort for the leaves of the merge sorts: the vector kernels where
+// they apply, std::sort otherwise.
+template <typename Iterator> void leaf_sort(Iterator start, Iterator end) {
+  leaf_sort_dispatch(start, end, simd_sortable<Iterator>());
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "radix_sort.h"
+#include "sort.h"
+#include "thread_pool.h"
+
+// A key and the position its value started at. Ties compare the positions,
+// so the comparison sorts order equal keys stably. Pairs are equal when
+// neither is less, which within one sort only happens for a pair and its
+// copy: the three-way partitions find no runs of equal pairs to skip, the
+// price of the stable order.
+template <typename Key, typename Index> struct keyed_index {
+  Key key;
+  Index index;
+
+  friend bool operator<(const keyed_index &a, const keyed_index &b) {
+    return a.key < b.key || (!(b.key < a.key) && a.index < b.index);
+  }
+  friend bool operator==(const keyed_index &a, const keyed_index &b) {
+    return a.index == b.index && !(a.key < b.key) && !(b.key < a.key);
+  }
+};
+
+// Reorders the values so that position i gets the one from position
+// source(i), source(i) being a reference to the entry of a permutation. With
+// the budget for a buffer the values are gathered into it and moved back in
+// parallel; otherwise the cycles of the permutation are followed in place,
+// marking every position done by pointing its entry to itself.
+template <typename Source, typename Values>
+void permute_by_index(size_t size, Source source, Values values,
+                      const sort_options &options) {
+  using T = typename std::iterator_traits<Values>::value_type;
+  using Index = typename std::decay<decltype(source(0))>::type;
+  auto &pool = sort_pool(options);
+  auto chunks = sort_chunks(size, options);
+  if (fits_scratch<T>(size, options)) {
+    auto buffer = std::vector<T>(size);
+    pool.parallel_for(0, chunks, [&](size_t chunk) {
+      for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks;
+           ++i)
+        buffer[i] = std::move(values[source(i)]);
+    });
+    pool.parallel_for(0, chunks, [&](size_t chunk) {
+      std::move(buffer.begin() + size * chunk / chunks,
+                buffer.begin() + size * (chunk + 1) / chunks,
+                values + size * chunk / chunks);
+    });
+    return;
+  }
+  for (auto i = size_t(0); i < size; ++i) {
+    if (source(i) == i)
+      continue;
+    auto value = std::move(values[i]);
+    auto hole = i;
+    while (source(hole) != i) {
+      auto from = size_t(source(hole));
+      values[hole] = std::move(values[from]);
+      source(hole) = Index(hole);
+      hole = from;
+    }
+    values[hole] = std::move(value);
+    source(hole) = Index(hole);
+  }
+}
+
+// Sorts copies of the keys tagged with their positions with sort_pairs, then
+// moves every value once to where its key went. The values are never swapped
+// around by the sort, which is what makes wide payloads cheap. The pairs are
+// allocated whatever the scratch budget, sizeof(keyed_index<Key, Index>)
+// bytes per element; the sort and the permutation get what they leave of it.
+template <typename Index, typename Keys, typename Values, typename Sort>
+void sort_by_key_indexed(Keys keys_begin, Keys keys_end, Values values_begin,
+                         const sort_options &options, Sort sort_pairs) {
+  using Key = typename std::iterator_traits<Keys>::value_type;
+  using Pair = keyed_index<Key, Index>;
+  auto size = size_t(std::distance(keys_begin, keys_end));
+  auto &pool = sort_pool(options);
+  auto chunks = sort_chunks(size, options);
+  auto rest = scratch_left(options, size * sizeof(Pair));
+  auto pairs = std::vector<Pair>(size);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      pairs[i] = Pair{std::move(keys_begin[i]), Index(i)};
+  });
+  sort_pairs(pairs.begin(), pairs.end(), rest);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      keys_begin[i] = std::move(pairs[i].key);
+  });
+  permute_by_index(
+      size, [&pairs](size_t i) -> Index & { return pairs[i].index; },
+      values_begin, rest);
+}
+
+// 32-bit positions while they suffice, which halves the pairs of 4-byte
+// keys.
+template <typename Keys, typename Values, typename Sort>
+void sort_by_key_with(Keys keys_begin, Keys keys_end, Values values_begin,
+                      const sort_options &options, Sort sort_pairs) {
+  if (size_t(std::distance(keys_begin, keys_end)) <= UINT32_MAX)
+    sort_by_key_indexed<uint32_t>(keys_begin, keys_end, values_begin, options,
+                                  sort_pairs);
+  else
+    sort_by_key_indexed<uint64_t>(keys_begin, keys_end, values_begin, options,
+                                  sort_pairs);
+}
+
+// Sorts [keys_begin, keys_end) and moves the values starting at
+// values_begin along, equal keys keeping their order, with
+// async_merge_sort.
+template <typename Keys, typename Values>
+void merge_sort_by_key(Keys keys_begin, Keys keys_end, Values values_begin,
+                       const sort_options &options = default_sort_options()) {
+  sort_by_key_with(keys_begin, keys_end, values_begin, options,
+                   [](auto start, auto end, const sort_options &options) {
+                     async_merge_sort(start, end, options);
+                   });
+}
+
+// merge_sort_by_key with async_quick_sort.
+template <typename Keys, typename Values>
+void quick_sort_by_key(Keys keys_begin, Keys keys_end, Values values_begin,
+                       const sort_options &options = default_sort_options()) {
+  sort_by_key_with(keys_begin, keys_end, values_begin, options,
+                   [](auto start, auto end, const sort_options &options) {
+                     async_quick_sort(start, end, options);
+                   });
+}
+
+// msd_radix_sort_pass of the keys that swaps the positions they came from
+// along. Buckets up to the leaf size are copied to tagged pairs for
+// quick_sort, and the buckets of equal keys left after the last digit have
+// their positions sorted, so equal keys end up in their original order.
+template <typename Keys, typename Index>
+void msd_radix_sort_by_key_pass(Keys keys, Index *positions, size_t size,
+                                unsigned pass, thread_pool &pool,
+                                const sort_options &options) {
+  using Key = typename std::iterator_traits<Keys>::value_type;
+  using Pair = keyed_index<Key, Index>;
+  if (size <= options.leaf_size) {
+    auto pairs = std::vector<Pair>(size);
+    for (auto i = size_t(0); i < size; ++i)
+      pairs[i] = Pair{std::move(keys[i]), positions[i]};
+    quick_sort(pairs.begin(), pairs.end());
+    for (auto i = size_t(0); i < size; ++i) {
+      keys[i] = std::move(pairs[i].key);
+      positions[i] = pairs[i].index;
+    }
+    return;
+  }
+
+  auto chunks = radix_chunks(size, pool);
+  auto counts = std::vector<radix_histogram>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto &count = counts[chunk];
+    count.fill(0);
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks; ++i)
+      ++count[radix_digit(keys[i], pass)];
+  });
+
+  auto heads = radix_histogram();
+  auto tails = radix_histogram();
+  auto sum = size_t(0);
+  for (auto digit = 0u; digit < RADIX_BUCKETS; ++digit) {
+    heads[digit] = sum;
+    for (auto &&count : counts)
+      sum += count[digit];
+    tails[digit] = sum;
+  }
+
+  for (auto digit = 0u; digit < RADIX_BUCKETS; ++digit) {
+    while (heads[digit] < tails[digit]) {
+      auto target = radix_digit(keys[heads[digit]], pass);
+      if (target == digit) {
+        ++heads[digit];
+        continue;
+      }
+      auto slot = heads[target]++;
+      std::iter_swap(keys + heads[digit], keys + slot);
+      std::swap(positions[heads[digit]], positions[slot]);
+    }
+  }
+
+  pool.parallel_for(0, RADIX_BUCKETS, [&](size_t digit) {
+    auto first = digit == 0 ? 0 : tails[digit - 1];
+    if (pass == 0)
+      quick_sort(positions + first, positions + tails[digit]);
+    else
+      msd_radix_sort_by_key_pass(keys + first, positions + first,
+                                 tails[digit] - first, pass - 1, pool,
+                                 options);
+  });
+}
+
+// lsd_radix_sort of the keys in place that moves the position every key
+// came from along with it, so a pass moves sizeof(Key) + sizeof(Index)
+// bytes per element instead of a padded pair, and the values are moved
+// once at the end. It holds a buffer of keys and two of positions; without
+// the budget for them the keys are sorted in place by
+// msd_radix_sort_by_key_pass, which needs only the positions.
+template <typename Index, typename Keys, typename Values>
+void radix_sort_by_key_indexed(Keys keys_begin, Keys keys_end,
+                               Values values_begin,
+                               const sort_options &options) {
+  using Key = typename std::iterator_traits<Keys>::value_type;
+  auto size = size_t(std::distance(keys_begin, keys_end));
+  if (size < 2)
+    return;
+  auto &pool = sort_pool(options);
+  auto rest = scratch_left(options, size * sizeof(Index));
+  if (size > options.scratch_budget / (sizeof(Key) + 2 * sizeof(Index))) {
+    auto sources = std::vector<Index>(size);
+    auto chunks = sort_chunks(size, options);
+    pool.parallel_for(0, chunks, [&](size_t chunk) {
+      for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks;
+           ++i)
+        sources[i] = Index(i);
+    });
+    msd_radix_sort_by_key_pass(keys_begin, sources.data(), size,
+                               radix_passes<Key>() - 1, pool, options);
+    permute_by_index(
+        size, [&sources](size_t i) -> Index & { return sources[i]; },
+        values_begin, rest);
+    return;
+  }
+  auto skip = radix_constant_digits(keys_begin, size, pool);
+  auto key_buffer = std::vector<Key>(size);
+  auto sources = std::vector<Index>(size);
+  auto source_buffer = std::vector<Index>(size);
+  auto keys = key_buffer.data();
+  auto positions = sources.data();
+  auto buffered_positions = source_buffer.data();
+  auto in_buffer = false;
+  auto passes = 0u;
+  for (auto pass = 0u; pass < skip.size(); ++pass) {
+    if (skip[pass])
+      continue;
+    if (in_buffer)
+      radix_scatter_with(keys, size, pass, pool, [&](size_t i, size_t slot) {
+        keys_begin[slot] = std::move(keys[i]);
+        positions[slot] = buffered_positions[i];
+      });
+    else if (passes == 0)
+      radix_scatter_with(keys_begin, size, pass, pool,
+                         [&](size_t i, size_t slot) {
+                           keys[slot] = std::move(keys_begin[i]);
+                           buffered_positions[slot] = Index(i);
+                         });
+    else
+      radix_scatter_with(keys_begin, size, pass, pool,
+                         [&](size_t i, size_t slot) {
+                           keys[slot] = std::move(keys_begin[i]);
+                           buffered_positions[slot] = positions[i];
+                         });
+    in_buffer = !in_buffer;
+    ++passes;
+  }
+  if (passes == 0)
+    return;
+
+  if (in_buffer) {
+    auto chunks = radix_chunks(size, pool);
+    pool.parallel_for(0, chunks, [&](size_t chunk) {
+      std::move(keys + size * chunk / chunks,
+                keys + size * (chunk + 1) / chunks,
+                keys_begin + size * chunk / chunks);
+    });
+    sources.swap(source_buffer);
+  }
+  key_buffer = std::vector<Key>();
+  source_buffer = std::vector<Index>();
+  permute_by_index(
+      size, [&sources](size_t i) -> Index & { return sources[i]; },
+      values_begin, rest);
+}
+
+// merge_sort_by_key with an LSD radix sort, for integer and floating point
+// keys. It needs sizeof(Index) bytes of scratch per element whatever the
+// budget, Index being uint32_t up to 2^32 elements.
+template <typename Keys, typename Values>
+void radix_sort_by_key(Keys keys_begin, Keys keys_end, Values values_begin,
+                       const sort_options &options = default_sort_options()) {
+  if (size_t(std::distance(keys_begin, keys_end)) <= UINT32_MAX)
+    radix_sort_by_key_indexed<uint32_t>(keys_begin, keys_end, values_begin,
+                                        options);
+  else
+    radix_sort_by_key_indexed<uint64_t>(keys_begin, keys_end, values_begin,
+                                        options);
+}
+
+template <typename Keys, typename Values>
+void sort_by_key_dispatch(Keys keys_begin, Keys keys_end, Values values_begin,
+                          const sort_options &options, std::true_type) {
+  radix_sort_by_key(keys_begin, keys_end, values_begin, options);
+}
+
+template <typename Keys, typename Values>
+void sort_by_key_dispatch(Keys keys_begin, Keys keys_end, Values values_begin,
+                          const sort_options &options, std::false_type) {
+  merge_sort_by_key(keys_begin, keys_end, values_begin, options);
+}
+
+// Radix sort for arithmetic keys, merge sort for everything else.
+template <typename Keys, typename Values>
+void sort_by_key(Keys keys_begin, Keys keys_end, Values values_begin,
+                 const sort_options &options = default_sort_options()) {
+  using Key = typename std::iterator_traits<Keys>::value_type;
+  sort_by_key_dispatch(keys_begin, keys_end, values_begin, options,
+                       std::is_arithmetic<Key>());
+}
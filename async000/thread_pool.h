@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join scheduler shared by the parallel sorts.
+//
+// Every worker owns a deque: it pushes and pops its own tasks at the back and
+// steals from the front of the other deques, so spawning a task costs a deque
+// push instead of an OS thread. A thread that waits for a task keeps running
+// other tasks meanwhile, and threads outside the pool (e.g. main) take part
+// the same way through a shared deque. That is why a pool for N cores only
+// starts N - 1 workers.
+class thread_pool {
+public:
+  explicit thread_pool(unsigned threads = std::thread::hardware_concurrency())
+      : stop(false) {
+    threads = std::max(threads, 1u);
+    for (auto i = 0u; i < threads; ++i) {
+      queues.emplace_back(new queue);
+    }
+    for (auto i = 1u; i < threads; ++i) {
+      workers.emplace_back([this, i] { worker_loop(i); });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &&worker : workers) {
+      worker.join();
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  // Number of threads that run tasks at the same time, the caller included.
+  unsigned concurrency() const { return unsigned(queues.size()); }
+
+  // Runs both functions, in parallel when a thread is free to steal the
+  // second one, and returns when both have finished. Exceptions propagate to
+  // the caller.
+  template <typename F1, typename F2> void invoke(F1 &&first, F2 &&second) {
+    if (workers.empty()) {
+      first();
+      second();
+      return;
+    }
+    function_task<F2> task(second);
+    push(&task);
+    try {
+      first();
+    } catch (...) {
+      wait(task);
+      throw;
+    }
+    if (try_pop(&task)) {
+      second();
+      return;
+    }
+    wait(task);
+    if (task.error) {
+      std::rethrow_exception(task.error);
+    }
+  }
+
+  // Calls function(i) for every i in [begin, end), splitting the range in
+  // halves so that idle threads can steal either one.
+  template <typename F>
+  void parallel_for(size_t begin, size_t end, const F &function) {
+    if (end - begin < 2) {
+      if (begin < end)
+        function(begin);
+      return;
+    }
+    auto middle = begin + (end - begin) / 2;
+    invoke([&] { parallel_for(begin, middle, function); },
+           [&] { parallel_for(middle, end, function); });
+  }
+
+private:
+  struct task {
+    virtual void run() = 0;
+    std::atomic<bool> done{false};
+    std::exception_ptr error;
+
+  protected:
+    ~task() = default;
+  };
+
+  template <typename F> struct function_task final : task {
+    explicit function_task(F &function) : function(function) {}
+    void run() override { function(); }
+    F &function;
+  };
+
+  struct queue {
+    std::mutex mutex;
+    std::deque<task *> tasks;
+  };
+
+  // Index of the calling thread's deque; 0 is shared by outside threads.
+  size_t own_index() const {
+    const auto &self = identity();
+    return self.pool == this ? self.index : 0;
+  }
+
+  struct worker_identity {
+    const thread_pool *pool = nullptr;
+    size_t index = 0;
+  };
+
+  static worker_identity &identity() {
+    static thread_local worker_identity self;
+    return self;
+  }
+
+  void push(task *task) {
+    auto &own = *queues[own_index()];
+    {
+      std::lock_guard<std::mutex> lock(own.mutex);
+      own.tasks.push_back(task);
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      ++pending;
+    }
+    wake.notify_one();
+  }
+
+  // Takes the task back if nobody has stolen it yet.
+  bool try_pop(task *task) {
+    auto &own = *queues[own_index()];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (own.tasks.empty() || own.tasks.back() != task) {
+      return false;
+    }
+    own.tasks.pop_back();
+    --pending;
+    return true;
+  }
+
+  // Newest task from the own deque, otherwise the oldest one of another.
+  task *find_task(size_t index) {
+    {
+      auto &own = *queues[index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        auto task = own.tasks.back();
+        own.tasks.pop_back();
+        --pending;
+        return task;
+      }
+    }
+    for (auto i = 1u; i < queues.size(); ++i) {
+      auto &victim = *queues[(index + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        auto task = victim.tasks.front();
+        victim.tasks.pop_front();
+        --pending;
+        return task;
+      }
+    }
+    return nullptr;
+  }
+
+  static void execute(task *task) {
+    try {
+      task->run();
+    } catch (...) {
+      task->error = std::current_exception();
+    }
+    task->done.store(true, std::memory_order_release);
+  }
+
+  void wait(task &task) {
+    auto index = own_index();
+    while (!task.done.load(std::memory_order_acquire)) {
+      if (auto other = find_task(index)) {
+        execute(other);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void worker_loop(size_t index) {
+    identity() = {this, index};
+    for (;;) {
+      if (auto task = find_task(index)) {
+        execute(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wake.wait(lock, [this] { return stop || pending > 0; });
+      if (stop) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  std::atomic<size_t> pending{0};
+  bool stop;
+};
+
+inline std::unique_ptr<thread_pool> &default_pool_instance() {
+  static auto pool = std::unique_ptr<thread_pool>(new thread_pool);
+  return pool;
+}
+
+// Pool used by the parallel sorts, sized to the number of hardware threads
+// unless set_default_concurrency chose another size.
+inline thread_pool &default_pool() { return *default_pool_instance(); }
+
+// Replaces the default pool with one running threads threads. No sort may be
+// running while it is called.
+inline void set_default_concurrency(unsigned threads) {
+  auto &pool = default_pool_instance();
+  if (pool->concurrency() != std::max(threads, 1u))
+    pool.reset(new thread_pool(threads));
+}
+
+// The default pool if it has at most threads threads, otherwise a smaller
+// pool of exactly that many, created on first use and kept for later calls.
+inline thread_pool &pool_for(unsigned threads) {
+  threads = std::max(threads, 1u);
+  if (threads >= default_pool().concurrency())
+    return default_pool();
+  static std::mutex mutex;
+  static std::map<unsigned, std::unique_ptr<thread_pool>> pools;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &pool = pools[threads];
+  if (!pool)
+    pool.reset(new thread_pool(threads));
+  return *pool;
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "generators.h"
+#include "sort.h"
+
+// Data and unified cache sizes in bytes, 0 where sysfs does not say.
+struct cache_sizes {
+  size_t l1 = 0;
+  size_t l2 = 0;
+  size_t l3 = 0;
+};
+
+inline size_t parse_cache_size(const std::string &text) {
+  auto size = size_t(std::strtoull(text.c_str(), nullptr, 10));
+  if (text.find('K') != std::string::npos)
+    return size << 10;
+  if (text.find('M') != std::string::npos)
+    return size << 20;
+  return size;
+}
+
+inline cache_sizes read_cache_sizes() {
+  auto sizes = cache_sizes();
+  for (auto index = 0;; ++index) {
+    auto dir = "/sys/devices/system/cpu/cpu0/cache/index" +
+               std::to_string(index) + "/";
+    auto level = 0;
+    auto type = std::string();
+    auto size = std::string();
+    if (!(std::ifstream(dir + "level") >> level))
+      return sizes;
+    std::ifstream(dir + "type") >> type;
+    std::ifstream(dir + "size") >> size;
+    if (type == "Instruction")
+      continue;
+    if (level == 1)
+      sizes.l1 = parse_cache_size(size);
+    else if (level == 2)
+      sizes.l2 = parse_cache_size(size);
+    else if (level == 3)
+      sizes.l3 = parse_cache_size(size);
+  }
+}
+
+inline std::string cpu_model() {
+  auto cpuinfo = std::ifstream("/proc/cpuinfo");
+  auto line = std::string();
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      auto colon = line.find(':');
+      if (colon != std::string::npos)
+        return line.substr(line.find_first_not_of(' ', colon + 1));
+    }
+  }
+  return "unknown";
+}
+
+// Identifies the machine a profile entry was measured on.
+inline std::string machine_signature() {
+  auto caches = read_cache_sizes();
+  auto out = std::ostringstream();
+  out << cpu_model() << ", " << std::thread::hardware_concurrency()
+      << " threads, caches " << caches.l1 << "/" << caches.l2 << "/"
+      << caches.l3;
+  return out.str();
+}
+
+// Powers of two from low to high elements of int, at least one.
+inline std::vector<size_t> cutoff_candidates(size_t low, size_t high) {
+  auto candidates = std::vector<size_t>();
+  for (auto n = size_t(1) << 10; n <= std::max(high, size_t(1) << 10);
+       n *= 2) {
+    if (n >= low)
+      candidates.push_back(n);
+  }
+  if (candidates.empty())
+    candidates.push_back(sort_options().leaf_size);
+  return candidates;
+}
+
+// Best of a few runs of sort with options on copies of keys.
+template <typename Sort>
+double time_sort(const std::vector<int> &keys, const Sort &sort,
+                 const sort_options &options) {
+  constexpr auto RUNS = 3;
+  auto best = 0.0;
+  for (auto run = 0; run < RUNS; ++run) {
+    auto copy = keys;
+    auto start = std::chrono::steady_clock::now();
+    sort(copy.begin(), copy.end(), options);
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    if (run == 0 || seconds < best)
+      best = seconds;
+  }
+  return best;
+}
+
+// Measures the leaf size and task grain for base on random keys. Leaves are
+// tried from a quarter of L1 to all of L2, since a leaf is sorted best while
+// it stays in a private cache. The grain is tried from L1 up to the share of
+// L3 each thread gets, on the parallel merge sort with the chosen leaf.
+inline sort_options tune_sort_options(sort_options base) {
+  using Iterator = std::vector<int>::iterator;
+  constexpr auto KEY = sizeof(int);
+  auto caches = read_cache_sizes();
+  auto l1 = caches.l1 ? caches.l1 : size_t(32) << 10;
+  auto l2 = caches.l2 ? caches.l2 : size_t(256) << 10;
+  auto l3 = caches.l3 ? caches.l3 : l2;
+  auto threads = size_t(sort_pool(base).concurrency());
+
+  auto keys = std::vector<int>(size_t(1) << 20);
+  fill_uniform(keys, std::numeric_limits<int>::min(),
+               std::numeric_limits<int>::max());
+  auto best = base;
+  auto candidate = base;
+  auto fastest = 0.0;
+
+  for (auto leaf : cutoff_candidates(l1 / 4 / KEY, l2 / KEY)) {
+    candidate.leaf_size = leaf;
+    auto seconds = time_sort(keys, merge_sort<Iterator>, candidate);
+    if (fastest == 0 || seconds < fastest) {
+      fastest = seconds;
+      best.leaf_size = leaf;
+    }
+  }
+
+  candidate.leaf_size = best.leaf_size;
+  fastest = 0;
+  auto grains = cutoff_candidates(l1 / KEY, l3 / threads / KEY);
+  for (auto grain : grains) {
+    if (grain > keys.size() / 4 && grain != grains.front())
+      break;
+    candidate.task_grain = grain;
+    auto seconds = time_sort(keys, async_merge_sort<Iterator>, candidate);
+    if (fastest == 0 || seconds < fastest) {
+      fastest = seconds;
+      best.task_grain = grain;
+    }
+  }
+  return best;
+}
+
+// Profiles hold one line per machine: the leaf and grain, then the
+// signature, so machines that share a home directory keep their own.
+inline bool load_cutoffs(const std::string &file, sort_options &options) {
+  auto in = std::ifstream(file);
+  auto signature = machine_signature();
+  auto line = std::string();
+  while (std::getline(in, line)) {
+    auto entry = std::istringstream(line);
+    auto leaf = size_t(0);
+    auto grain = size_t(0);
+    auto machine = std::string();
+    if (entry >> leaf >> grain && std::getline(entry >> std::ws, machine) &&
+        machine == signature && leaf > 0 && grain > 0) {
+      options.leaf_size = leaf;
+      options.task_grain = grain;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void save_cutoffs(const std::string &file,
+                         const sort_options &options) {
+  auto signature = machine_signature();
+  auto lines = std::vector<std::string>();
+  {
+    auto in = std::ifstream(file);
+    auto line = std::string();
+    while (std::getline(in, line)) {
+      auto at = line.find(' ', line.find(' ') + 1);
+      if (at == std::string::npos || line.substr(at + 1) != signature)
+        lines.push_back(line);
+    }
+  }
+  auto out = std::ofstream(file);
+  for (auto &&line : lines)
+    out << line << "\n";
+  out << options.leaf_size << " " << options.task_grain << " " << signature
+      << "\n";
+}
+
+// Profile in the home directory, or in the working directory without one.
+inline std::string default_profile_file() {
+  auto home = std::getenv("HOME");
+  return home ? std::string(home) + "/.sort_cutoffs" : ".sort_cutoffs";
+}
+
+// Sets the leaf size and task grain of default_sort_options() from the
+// profile entry of this machine, tuning and saving them first if there is
+// none or retune is set. Returns whether it tuned.
+inline bool load_or_tune_cutoffs(const std::string &file, bool retune) {
+  auto &options = default_sort_options();
+  if (!retune && load_cutoffs(file, options))
+    return false;
+  options = tune_sort_options(options);
+  save_cutoffs(file, options);
+  return true;
+}
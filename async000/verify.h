@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "random.h"
+#include "thread_pool.h"
+
+constexpr auto VERIFY_CHUNK = size_t(1) << 16;
+
+// Order-independent fingerprint of a multiset of keys: two sums of
+// differently seeded 64-bit mixes of every key. Equal multisets always
+// match, while a changed, lost or duplicated key has to cancel out in both
+// sums to go unnoticed.
+struct multiset_hash {
+  uint64_t first = 0;
+  uint64_t second = 0;
+
+  bool operator==(const multiset_hash &other) const {
+    return first == other.first && second == other.second;
+  }
+  bool operator!=(const multiset_hash &other) const {
+    return !(*this == other);
+  }
+};
+
+inline size_t verify_chunks(size_t size, thread_pool &pool) {
+  return std::max<size_t>(
+      std::min<size_t>(pool.concurrency() * 4, size / VERIFY_CHUNK), 1);
+}
+
+template <typename Iterator>
+multiset_hash hash_multiset(Iterator start, Iterator end,
+                            thread_pool &pool = default_pool()) {
+  auto size = size_t(end - start);
+  auto chunks = verify_chunks(size, pool);
+  auto partial = std::vector<multiset_hash>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto hash = multiset_hash();
+    for (auto i = size * chunk / chunks; i < size * (chunk + 1) / chunks;
+         ++i) {
+      auto key = uint64_t(start[i]);
+      hash.first += mix_key(key);
+      hash.second += mix_key(key ^ 0x9e3779b97f4a7c15);
+    }
+    partial[chunk] = hash;
+  });
+  auto total = multiset_hash();
+  for (auto &&hash : partial) {
+    total.first += hash.first;
+    total.second += hash.second;
+  }
+  return total;
+}
+
+// Index of the first element smaller than its predecessor, or the size if
+// the range is sorted. Each chunk also checks the pair across its start.
+template <typename Iterator>
+size_t first_unsorted(Iterator start, Iterator end,
+                      thread_pool &pool = default_pool()) {
+  auto size = size_t(end - start);
+  auto chunks = verify_chunks(size, pool);
+  auto partial = std::vector<size_t>(chunks);
+  pool.parallel_for(0, chunks, [&](size_t chunk) {
+    auto begin = size * chunk / chunks;
+    auto last = size * (chunk + 1) / chunks;
+    auto from = start + (begin > 0 ? begin - 1 : 0);
+    auto index = size_t(std::is_sorted_until(from, start + last) - start);
+    partial[chunk] = index < last ? index : size;
+  });
+  return size == 0 ? 0 : *std::min_element(partial.begin(), partial.end());
+}
+
+struct verification {
+  size_t size;
+  size_t first_unsorted; // the size if sorted
+  bool permutation;      // same multiset of keys as the input
+  bool ok() const { return permutation && first_unsorted == size; }
+};
+
+// Checks in O(n), in parallel, that [start, end) is sorted and holds the
+// keys the input with hash input_hash held.
+template <typename Iterator>
+verification verify_sorted(Iterator start, Iterator end,
+                           const multiset_hash &input_hash) {
+  auto result = verification();
+  result.size = size_t(end - start);
+  result.first_unsorted = first_unsorted(start, end);
+  result.permutation = hash_multiset(start, end) == input_hash;
+  return result;
+}
+
+// Reports a failed verification with the keys around the first unsorted
+// position instead of the whole output.
+template <typename Iterator>
+void print_verification_failure(std::ostream &out, const std::string &name,
+                                const verification &result, Iterator start) {
+  constexpr auto WINDOW = size_t(8);
+  out << name << " sorting failed";
+  if (!result.permutation)
+    out << ": the output is not a permutation of the input";
+  out << std::endl;
+  if (result.first_unsorted == result.size)
+    return;
+  auto begin = result.first_unsorted - std::min(result.first_unsorted, WINDOW);
+  auto last = std::min(result.first_unsorted + WINDOW, result.size);
+  out << "out of order at index " << result.first_unsorted << ", elements "
+      << begin << ".." << last - 1 << ":" << std::endl;
+  for (auto i = begin; i < last; ++i)
+    out << (i == result.first_unsorted ? " [" : " ") << start[i]
+        << (i == result.first_unsorted ? "]" : "");
+  out << std::endl;
+}